@@ -24,6 +24,15 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <cstdlib>
 #include <cstdint>
 #include <chrono>
+#include <string>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <libModbusSystematomSPU_ring.h>
+#include <libModbusSystematomSPU_metrics.h>
+#include <libModbusSystematomSPU_error.h>
 
 struct SPU_DATA
 {
@@ -52,30 +61,346 @@ struct SPU_DATA
     int     RDY             = -1;
     int     TEST            = -1;
     int     XXXX            = -1;
+    unsigned long long SEQ  = 0;    //Number of the sample (increases by one at every successful read)
+    std::chrono::nanoseconds AGE{0};//Time since the sample was read from the bus (background polling only)
+};
+
+//Fields of SPU_DATA that can be read from the SPU (one bit per field, can be combined with |)
+enum SPU_FIELD : uint32_t
+{
+    SPU_FIELD_N_DATA_FP       = 1u << 0,
+    SPU_FIELD_T_DATA_FP       = 1u << 1,
+    SPU_FIELD_F1_DATA_FP      = 1u << 2,
+    SPU_FIELD_F2_DATA_FP      = 1u << 3,
+    SPU_FIELD_F3_DATA_FP      = 1u << 4,
+    SPU_FIELD_EMR_N_THRESHOLD = 1u << 5,
+    SPU_FIELD_WRN_N_THRESHOLD = 1u << 6,
+    SPU_FIELD_EMR_T_THRESHOLD = 1u << 7,
+    SPU_FIELD_WRN_T_THRESHOLD = 1u << 8,
+    SPU_FIELD_EMR_N           = 1u << 9,
+    SPU_FIELD_WRN_N           = 1u << 10,
+    SPU_FIELD_EMR_T           = 1u << 11,
+    SPU_FIELD_WRN_T           = 1u << 12,
+    SPU_FIELD_R1              = 1u << 13,
+    SPU_FIELD_R2              = 1u << 14,
+    SPU_FIELD_R3              = 1u << 15,
+    SPU_FIELD_RDY             = 1u << 16,
+    SPU_FIELD_TEST            = 1u << 17,
+    SPU_FIELD_XXXX            = 1u << 18,
+
+    //Groups used by get_all_update_*()
+    SPU_FIELD_NT         = SPU_FIELD_N_DATA_FP | SPU_FIELD_T_DATA_FP,
+    SPU_FIELD_F          = SPU_FIELD_F1_DATA_FP | SPU_FIELD_F2_DATA_FP | SPU_FIELD_F3_DATA_FP,
+    SPU_FIELD_NTF        = SPU_FIELD_NT | SPU_FIELD_F,
+    SPU_FIELD_THRESHOLDS = SPU_FIELD_EMR_N_THRESHOLD | SPU_FIELD_WRN_N_THRESHOLD |
+                           SPU_FIELD_EMR_T_THRESHOLD | SPU_FIELD_WRN_T_THRESHOLD,
+    SPU_FIELD_BOOL       = 0x3FFu << 9,
+    SPU_FIELD_ALL        = (1u << 19) - 1
+};
+
+constexpr int SPU_FIELD_COUNT        = 19;
+constexpr int SPU_MAX_READ_REGISTERS = 125; //Limite do protocolo MODBUS para a função 0x03
+
+//Cost model used by the read planner, in microseconds of bus time
+struct SPU_READ_COST
+{
+    float transactionCost = 0;  //Fixed cost of one transaction (request frame, turnaround, response header, gaps)
+    float registerCost    = 0;  //Cost of each register carried in the response
+};
+
+//One modbus_read_registers() call
+struct SPU_READ_BLOCK
+{
+    int start_address = 0;
+    int num_registers = 0;
+};
+
+//Set of transactions that reads a set of fields
+struct SPU_READ_PLAN
+{
+    uint32_t       fields    = 0;   //Fields covered by the plan (SPU_FIELD mask)
+    int            numBlocks = 0;   //Number of transactions
+    SPU_READ_BLOCK blocks[SPU_FIELD_COUNT];
+    float          cost      = 0;   //Estimated bus time of the plan (µs)
 };
 
 
+//One field group of the multi-rate polling scheduler
+struct SPU_SCHEDULE_GROUP
+{
+    uint32_t fields = 0;                    //SPU_FIELD mask
+    std::chrono::microseconds period{0};    //0 = every cycle
+    int priority = 0;                       //Served first when the line cannot carry every due group
+};
+
+//Real-time settings of the polling thread (opt-in; SCHED_FIFO and mlockall need CAP_SYS_NICE / CAP_IPC_LOCK
+//or matching rlimits, otherwise they are reported and polling goes on without them)
+struct SPU_REALTIME
+{
+    bool enabled    = false;
+    int  priority   = 80;       //SCHED_FIFO priority (1-99)
+    int  cpu        = -1;       //CPU the thread is pinned to (-1 = any)
+    bool lockMemory = true;     //mlockall(): no page faults in the loop (applies to the whole process)
+};
+
+//Flags at 200 Hz, N and T at 100 Hz, F1-F3 at 10 Hz and the thresholds every 10 s, each period stretched to at
+//least one read of its group (and of the faster ones) at `cost` (e.g. spu.get_read_cost() for the line in use)
+std::vector<SPU_SCHEDULE_GROUP> libModbusSystematomSPU_default_schedule(const SPU_READ_COST& cost = SPU_READ_COST());
+
+//Fixed-size binary form of SPU_DATA (64 bytes) for files and shared memory
+struct SPU_RECORD
+{
+    int64_t  time_ns   = 0;     //TIME in nanoseconds since the epoch
+    uint64_t seq       = 0;
+    float    fp[9]     = {};    //N, T, F1, F2, F3 and the thresholds (SPU_FIELD order)
+    uint16_t flags     = 0;     //Bit k = flag k (EMR_N to XXXX, SPU_FIELD order)
+    uint16_t flagsKnown = 0;    //Bit k clear = flag k was never read (-1 in SPU_DATA)
+    int8_t   state     = -1;
+    uint8_t  reserved[3] = {};
+    uint32_t commit    = 0;     //Free for the container (journal commit marker, ...)
+};
+static_assert(sizeof(SPU_RECORD) == 64, "SPU_RECORD is a file format");
+
+//Samples acquired by one libModbusSystematomSPU, each one seen exactly once by one consumer thread
+class libModbusSystematomSPU_stream {
+public:
+    explicit libModbusSystematomSPU_stream(size_t capacity) : ring(capacity) {}
+
+    //Copy up to max samples to out, oldest first
+    size_t   drain(SPU_DATA* out, size_t max) { return ring.pop(out, max); }
+    bool     next(SPU_DATA& out)              { return ring.pop(out); }
+
+    //Call f for every pending sample (read in place, without copying out)
+    template <typename F>
+    size_t   for_each(F&& f)
+    {
+        size_t n = 0;
+        for (const SPU_DATA* d; (d = ring.front()) != nullptr; ring.drop(), n++) f(*d);
+        return n;
+    }
+
+    size_t   pending()  const { return ring.size(); }
+    size_t   capacity() const { return ring.capacity(); }
+    uint64_t overruns() const { return ring.overruns(); } //Samples lost because the consumer fell behind
+
+    //Range over the pending samples: for (const SPU_DATA& d : *stream) consumes them
+    class iterator {
+    public:
+        explicit iterator(libModbusSystematomSPU_stream* s) : s(s) {}
+        const SPU_DATA& operator*() const { return *s->ring.front(); }
+        iterator& operator++()            { s->ring.drop(); return *this; }
+        bool operator!=(const iterator&) const { return s && s->ring.front() != nullptr; }
+    private:
+        libModbusSystematomSPU_stream* s;
+    };
+    iterator begin() { return iterator(this); }
+    iterator end()   { return iterator(nullptr); }
+
+    //Producer side, used by libModbusSystematomSPU
+    bool push(const SPU_DATA& data) { return ring.push(data); }
+
+private:
+    libModbusSystematomSPU_ring<SPU_DATA> ring;
+};
+
 void libModbusSystematomSPU_license();
 
+//Estimate the cost of a transaction in a 8N1 line at baudrate, given the time the SPU takes to answer
+SPU_READ_COST libModbusSystematomSPU_cost(int baudrate, float turnaround_us);
+
+//Merge the registers of fields into the cheapest set of transactions according to cost
+SPU_READ_PLAN libModbusSystematomSPU_plan(uint32_t fields, const SPU_READ_COST& cost);
+
+//Number of registers of the register image (addresses 0x0000 to 0x006D)
+constexpr int SPU_REGISTER_IMAGE_SIZE = 0x006E;
+
+SPU_RECORD libModbusSystematomSPU_pack  (const SPU_DATA& data);
+SPU_DATA   libModbusSystematomSPU_unpack(const SPU_RECORD& record);
+
+//Write `fields` of data to regs (indexed by address) exactly as the SPU presents them
+void libModbusSystematomSPU_encode(const SPU_DATA& data, uint16_t* regs, uint32_t fields = SPU_FIELD_ALL);
+
+//Read `fields` of data from regs (indexed by address)
+void libModbusSystematomSPU_decode(const uint16_t* regs, SPU_DATA& data, uint32_t fields = SPU_FIELD_ALL);
+
+//Serial link and transaction policy of a libModbusSystematomSPU_bus
+struct SPU_CONFIG
+{
+    int  baudrate  = 57600;
+    bool nativeRtu = false;                             //Built-in RTU engine instead of libmodbus (serial only)
+    bool lowLatency = true;                             //Ask the serial driver for ASYNC_LOW_LATENCY when it supports it
+    std::chrono::microseconds responseTimeout{500000};  //Until the first byte of the answer
+    std::chrono::microseconds byteTimeout{500000};      //Between two bytes of the answer
+    int retries = 0;                                    //Extra attempts of a failed transaction (not on exception answers)
+    std::chrono::microseconds hedgeTimeout{0};          //Shorter response timeout of the first attempt (0 = responseTimeout)
+    bool autoTune = false;                              //Run autoTune() on the first connection
+
+    bool backgroundConnect = false;                     //Open the line in the supervisor thread: constructors never block
+                                                        //and reads give STATE 2 until it is up
+    bool autoReconnect = true;                          //The supervisor reopens a line that failed or was lost
+    std::chrono::milliseconds reconnectMin{100};        //Backoff between attempts, doubled up to reconnectMax
+    std::chrono::milliseconds reconnectMax{10000};
+
+    std::chrono::microseconds maxAge{0};                //Device reads accept fields read this recently instead of
+                                                        //reading them again (0 = always read)
+};
+
+//Read paths with a latency histogram of their own (time seen by the caller)
+enum SPU_PATH : int
+{
+    SPU_PATH_GET_ALL = 0,
+    SPU_PATH_UPDATE_NT,
+    SPU_PATH_UPDATE_F,
+    SPU_PATH_UPDATE_NTF,
+    SPU_PATH_UPDATE_BOOL,
+    SPU_PATH_GET_FIELDS,
+    SPU_PATH_GETTER,        //The single-field getters
+    SPU_PATH_POLL,          //One acquisition of the polling thread
+    SPU_PATH_COUNT
+};
+
+//Health of one line: every device on a shared bus adds to the same counters
+struct SPU_BUS_METRICS
+{
+    SPU_HISTOGRAM transaction;      //One read_registers(), from the first request to the last answer
+    uint64_t transactions = 0;
+    uint64_t failures     = 0;      //Transactions still failing after every retry
+    uint64_t timeouts     = 0;      //Attempts without (complete) answer
+    uint64_t crcErrors    = 0;
+    uint64_t exceptions   = 0;      //Exception answers of the SPU
+    uint64_t otherErrors  = 0;      //Wrong slave, malformed answer, I/O errors
+    uint64_t retries      = 0;
+    uint64_t reconnects   = 0;      //tryConnect() calls after the first one
+};
+
+struct SPU_METRICS
+{
+    SPU_HISTOGRAM paths[SPU_PATH_COUNT];
+    uint64_t samples          = 0;  //Acquisitions with STATE 0
+    uint64_t failedSamples    = 0;  //Acquisitions with STATE 1 or 2
+    double   samplesPerSecond = 0;  //Successful acquisitions over the last second or so
+    SPU_HISTOGRAM pollLateness;     //How late the polling thread woke up for each cycle (period jitter)
+    uint64_t pollCycles       = 0;
+    uint64_t deadlineMisses   = 0;  //Cycles that ended after the period of their most urgent group
+    SPU_BUS_METRICS bus;
+};
+
+//Prometheus text exposition format of m; labels (like `port="/dev/ttyUSB0",slave="1"`) go on every series
+std::string libModbusSystematomSPU_prometheus(const SPU_METRICS& m, const std::string& labels = "");
+
+struct libModbusSystematomSPU_bus_private;
+
+//One RS-485 line: owns the serial port and its Modbus context and serves every SPU (slave ID) on it.
+//Transactions of all devices are served in arrival order, separated by the minimum silent interval.
+//A portname like "tcp://127.0.0.1:1502" uses Modbus TCP instead (simulator, gateway).
+//nativeRtu replaces libmodbus on a serial line by the built-in RTU engine (libModbusSystematomSPU_rtu.h).
+//A supervisor thread reopens the line when it is lost (see SPU_CONFIG); meanwhile reads fail at once with STATE 2.
+class libModbusSystematomSPU_bus {
+public:
+    libModbusSystematomSPU_bus(std::string portname, int baudrate = 57600, bool nativeRtu = false);
+    libModbusSystematomSPU_bus(std::string portname, SPU_CONFIG config);
+    ~libModbusSystematomSPU_bus();
+
+    bool tryConnect();
+    bool isConnected();
+    //Wait until the line is up (background connection or reconnection). Returns 1 on timeout.
+    bool waitConnected(std::chrono::milliseconds timeout);
+
+    std::string  get_portname();
+    int          get_baudrate();
+    bool         isNativeRtu();
+    SPU_CONFIG   get_config();
+
+    //Probe `baudrates` (fastest first) with `probes` reads of `slave` and keep the fastest one answering
+    //(almost) all of them; then set the timeouts just above the p99 of the measured turnaround. Call it before
+    //any polling starts. Returns 1 (and restores the previous configuration) if no baudrate answered.
+    bool autoTune(int slave = 0x01, std::vector<int> baudrates = {115200, 57600, 38400, 19200, 9600}, int probes = 32);
+    //p99 of the time the SPU takes to answer, as measured by autoTune() (0 = not tuned)
+    std::chrono::microseconds get_turnaround();
+
+    SPU_BUS_METRICS get_metrics();
+
+    //Same contract as modbus_read_registers() (returns -1 and sets errno on failure).
+    //request may point to the prebuilt RTU frame of this read, sent as is by the native engine.
+    int read_registers(int slave, int start_address, int num_registers, uint16_t* dest, const uint8_t* request = nullptr);
+
+private:
+    libModbusSystematomSPU_bus_private* _p;
+
+    bool openLine();
+    void closeLine();
+    void takeLine();
+    void releaseLine();
+    void setConfig(const SPU_CONFIG& config, std::chrono::microseconds turnaround);
+    void supervise(bool failed);
+};
+
 struct libModbusSystematomSPU_private;
 
 class libModbusSystematomSPU {
 public:
     libModbusSystematomSPU(std::string portname);
+    libModbusSystematomSPU(std::string portname, SPU_CONFIG config);
+    //Device `slave` on a line shared with other SPUs
+    libModbusSystematomSPU(std::shared_ptr<libModbusSystematomSPU_bus> bus, int slave);
     ~libModbusSystematomSPU();
 
     bool tryConnect();
+    //autoTune() of the bus on this slave, then the read planner is fed the measured turnaround
+    bool autoTune();
     
     //Get the name of the port (who am I?)
     std::string  get_portname();
+    int          get_slave();
+    std::shared_ptr<libModbusSystematomSPU_bus> get_bus();
 
-    //Get all the struct and update all (or part) of the variables
+    //Get all the struct and update all (or part) of the variables.
+    //Any number of threads may call the readers at once: a call whose fields are all being read by another
+    //one waits for that read and shares its result, so concurrent callers cause a single transaction.
     SPU_DATA get_all             ();
+    //Accept fields read less than maxAge ago (AGE tells how old the oldest one is) instead of a new read
+    SPU_DATA get_all             (std::chrono::microseconds maxAge);
     SPU_DATA get_all_update_NT   ();
     SPU_DATA get_all_update_F    ();
     SPU_DATA get_all_update_NTF  ();
     SPU_DATA get_all_update_bool ();
 
+    //Read a caller-defined set of fields (SPU_FIELD mask) using a single read plan
+    SPU_DATA get_fields          (uint32_t fields);
+    SPU_DATA get_fields          (uint32_t fields, std::chrono::microseconds maxAge);
+
+    //Read planner configuration and inspection
+    void          set_read_cost  (SPU_READ_COST cost);
+    SPU_READ_COST get_read_cost  ();
+    SPU_READ_PLAN plan           (uint32_t fields);
+
+    //Background polling: a thread reads `fields` every `period` (0 = back-to-back) and get_all(),
+    //get_fields() and the getters return the newest sample without touching the bus
+    bool startPolling(std::chrono::microseconds period = std::chrono::microseconds(0), uint32_t fields = SPU_FIELD_ALL);
+    //Multi-rate polling: each group is read on its own period, the groups due together in one read plan
+    //(e.g. libModbusSystematomSPU_default_schedule(get_read_cost())). Each cycle starts at an absolute deadline.
+    bool startPolling(std::vector<SPU_SCHEDULE_GROUP> schedule, SPU_REALTIME realtime = SPU_REALTIME());
+    void stopPolling();
+    bool isPolling();
+
+    //Every sample acquired (by the polling thread or by a direct read) is copied to each stream
+    std::shared_ptr<libModbusSystematomSPU_stream> subscribe(size_t capacity = 1024);
+    void unsubscribe(const std::shared_ptr<libModbusSystematomSPU_stream>& stream);
+
+    //Called for every sample in the thread that acquired it (keep it short); returns an id for removal.
+    //A callback may add or remove callbacks; one removed while a sample is being published may still get that sample.
+    int  add_sample_callback(std::function<void(const SPU_DATA&)> callback);
+    void remove_sample_callback(int id);
+
+    //Latency histograms and counters of this device (and of its bus), without stopping anything
+    SPU_METRICS get_metrics();
+    std::string get_prometheus();
+
+    //Play a journal (see libModbusSystematomSPU_journal.h) back through the getters, streams and callbacks,
+    //`speed` times faster than recorded (0 = as fast as possible). Stopped by stopPolling(); at the end of the
+    //journal isPolling() turns false by itself and the getters read the device again.
+    bool startReplay(std::string journalPath, double speed = 1);
+
     //Get just variable
     float get_N_DATA_FP          ();
     float get_T_DATA_FP          ();
@@ -100,8 +425,12 @@ public:
 private:
     libModbusSystematomSPU_private* _p;
 
-    std::string stdErrorMsg(std::string functionName, std::string errorMsg, std::string exptionMsg);
-    float conv2RegsToFloat(uint16_t data1, uint16_t data2);
-    float get_1_DATA_FP(int start_address);
-    uint16_t get_1_DATA(int address);
+    template <SPU_FIELD F> auto getField(const char* functionName);
+    int readFields(uint32_t fields, SPU_PATH path, const char* functionName, SPU_DATA& out);
+    int readFields(uint32_t fields, SPU_PATH path, const char* functionName, SPU_DATA& out, std::chrono::microseconds maxAge);
+    int leadRead(uint32_t fields, SPU_DATA& out, const char* functionName, std::unique_lock<std::mutex>& lock);
+    int exclusiveRead(uint32_t fields, SPU_DATA& out, const char* functionName);
+    int acquire(uint32_t fields, SPU_DATA& data, const char* functionName);
+    void pollLoop();
+    void publish(const SPU_DATA& data);
 };
@@ -0,0 +1,63 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <libModbusSystematomSPU.h>
+
+#include <vector>
+#include <functional>
+
+//One acquisition cycle of every channel
+struct SPU_FUSED
+{
+    unsigned long long SEQ = 0;                                  //Number of the cycle
+    std::chrono::steady_clock::time_point START;                 //Instant every channel was released to read
+    std::chrono::nanoseconds WINDOW{0};                          //Spread between the first and the last ACQUIRED
+    std::vector<SPU_DATA> CHANNELS;                              //One sample per channel, in constructor order
+    std::vector<std::chrono::steady_clock::time_point> ACQUIRED; //Middle of each channel's transaction
+};
+
+struct libModbusSystematomSPU_acquisition_private;
+
+//Polls several SPUs (usually one per USB-RS485 adapter) at the same time, one worker thread per
+//channel. Every cycle starts all channels together, so a cycle lasts as long as the slowest one.
+class libModbusSystematomSPU_acquisition {
+public:
+    //Open every port in parallel (a dead adapter does not delay the others)
+    libModbusSystematomSPU_acquisition(std::vector<std::string> portnames);
+    libModbusSystematomSPU_acquisition(std::vector<std::shared_ptr<libModbusSystematomSPU>> channels);
+    ~libModbusSystematomSPU_acquisition();
+
+    bool start(std::chrono::microseconds period = std::chrono::microseconds(0), uint32_t fields = SPU_FIELD_ALL);
+    void stop();
+    bool isRunning();
+
+    //Newest complete cycle
+    SPU_FUSED get_fused();
+
+    //Called once per cycle by the acquisition threads, before the next cycle starts (keep it short)
+    void set_callback(std::function<void(const SPU_FUSED&)> callback);
+
+    size_t get_channel_count();
+    std::shared_ptr<libModbusSystematomSPU> get_channel(size_t index);
+
+private:
+    libModbusSystematomSPU_acquisition_private* _p;
+};
@@ -0,0 +1,93 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <libModbusSystematomSPU.h>
+
+//Resolutions kept by libModbusSystematomSPU_aggregator
+enum SPU_RESOLUTION : int
+{
+    SPU_RESOLUTION_SECOND = 0,
+    SPU_RESOLUTION_MINUTE,
+    SPU_RESOLUTION_HOUR,
+    SPU_RESOLUTION_COUNT
+};
+
+//Running statistics of one float field (Welford); two of them merge exactly
+struct SPU_RUNNING_STATS
+{
+    uint64_t count = 0;
+    float    min   = 0;
+    float    max   = 0;
+    double   mean  = 0;
+    double   m2    = 0;     //Sum of squared deviations from mean
+
+    double variance() const { return count ? m2 / count : 0; }  //Population variance
+    void add(float x);
+    void merge(const SPU_RUNNING_STATS& other);
+};
+
+//Summary of a time range. Durations hold each sample's values until the next sample (at most maxGap later).
+struct SPU_AGGREGATE
+{
+    std::chrono::system_clock::time_point start;    //Inclusive
+    std::chrono::system_clock::time_point end;      //Exclusive
+    std::chrono::nanoseconds covered{0};            //Time with samples (gaps over maxGap and failures excluded)
+
+    SPU_RUNNING_STATS N;
+    SPU_RUNNING_STATS T;
+    std::chrono::nanoseconds aboveWrnN{0};          //N_DATA_FP > WRN_N_THRESHOLD
+    std::chrono::nanoseconds aboveEmrN{0};
+    std::chrono::nanoseconds aboveWrnT{0};
+    std::chrono::nanoseconds aboveEmrT{0};
+    std::chrono::nanoseconds flagOn[10] = {};       //EMR_N to XXXX, SPU_FIELD order
+
+    //Fraction of the covered time the flag (SPU_FIELD_EMR_N .. SPU_FIELD_XXXX) was on
+    double dutyCycle(SPU_FIELD flag) const;
+    void merge(const SPU_AGGREGATE& other);
+};
+
+struct libModbusSystematomSPU_aggregator_private;
+
+//1 s, 1 min and 1 h buckets of N_DATA_FP and T_DATA_FP updated as samples arrive (O(1) per sample), kept in
+//fixed rings of `seconds`, `minutes` and `hours` buckets. Queries merge whole buckets and never see raw samples.
+//Thread-safe: feed it from a sample callback and query it from anywhere. Typical use:
+//    spu.add_sample_callback([&](const SPU_DATA& d){ aggregator.add(d); });
+class libModbusSystematomSPU_aggregator {
+public:
+    libModbusSystematomSPU_aggregator(size_t seconds = 3600, size_t minutes = 1440, size_t hours = 720,
+                                      std::chrono::nanoseconds maxGap = std::chrono::seconds(1));
+    ~libModbusSystematomSPU_aggregator();
+
+    //Account a sample (its TIME is clamped to be non-decreasing). A sample with STATE != 0 ends the
+    //current hold: the time until the next good sample is not covered. Returns 1 for those.
+    bool add(const SPU_DATA& data);
+
+    //Summary of [from, to), built from the coarsest buckets that fit. The edges are rounded out to the finest
+    //resolution still held for them (1 s while the second buckets last).
+    SPU_AGGREGATE query(std::chrono::system_clock::time_point from, std::chrono::system_clock::time_point to);
+
+    //Buckets of one resolution overlapping [from, to), oldest first (empty ones included). Returns how many.
+    size_t buckets(SPU_RESOLUTION resolution, std::chrono::system_clock::time_point from,
+                   std::chrono::system_clock::time_point to, SPU_AGGREGATE* out, size_t max);
+
+private:
+    libModbusSystematomSPU_aggregator_private* _p;
+};
@@ -0,0 +1,104 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <libModbusSystematomSPU.h>
+
+//Archive file: a 64-byte header followed by compressed blocks of up to blockSamples SPU_RECORDs, each one a
+//SPU_ARCHIVE_BLOCK header and its payload. The payload is one bit stream:
+//  time_ns and seq   delta-of-delta, zigzag, in 1/16/27/36/68-bit buckets
+//  state and flags   run-length: (state, flags, flagsKnown) and the length of each run
+//  fp[0..8]          XOR with the previous value of the column (Gorilla), column by column
+//The block headers are the index: the reader scans them when it opens the file, a block cut short by a crash
+//is dropped (and overwritten by the next writer).
+struct SPU_ARCHIVE_HEADER
+{
+    char     magic[8];          //"SPUARCH1"
+    uint32_t version;
+    uint32_t blockSamples;
+    int64_t  created_ns;
+    uint8_t  reserved[40];
+};
+static_assert(sizeof(SPU_ARCHIVE_HEADER) == 64, "SPU_ARCHIVE_HEADER is a file format");
+
+struct SPU_ARCHIVE_BLOCK
+{
+    uint32_t magic;             //SPU_ARCHIVE_BLOCK_MAGIC
+    uint32_t count;             //Samples in the block
+    int64_t  first_ns;          //time_ns of the first and the last sample
+    int64_t  last_ns;
+    uint64_t firstSeq;
+    uint32_t payloadSize;       //Bytes after this header
+    uint32_t checksum;          //FNV-1a of the payload
+    uint64_t offset;            //Of this header in the file (reader side only, 0 on disk)
+};
+static_assert(sizeof(SPU_ARCHIVE_BLOCK) == 48, "SPU_ARCHIVE_BLOCK is a file format");
+
+constexpr uint32_t SPU_ARCHIVE_BLOCK_MAGIC = 0x42555053;  //"SPUB"
+constexpr uint32_t SPU_ARCHIVE_MAX_BLOCK   = 65536;
+
+struct libModbusSystematomSPU_archive_private;
+
+//Append-only writer. Samples are kept in memory until a block is full (or flush()). Timestamps are stored
+//non-decreasing (a sample older than the previous one takes its time). Typical use:
+//    spu.add_sample_callback([&](const SPU_DATA& d){ archive.append(d); });
+class libModbusSystematomSPU_archive {
+public:
+    //Open (or create) the file and continue after its last complete block
+    libModbusSystematomSPU_archive(std::string path, uint32_t blockSamples = 4096);
+    ~libModbusSystematomSPU_archive();     //flush()
+
+    bool isOpen();
+    std::string get_path();
+    uint64_t size();                        //Samples, written and pending
+
+    bool append(const SPU_DATA& data);      //0 = success
+    bool flush();                           //Write the pending samples as a (short) block
+
+private:
+    libModbusSystematomSPU_archive_private* _p;
+    bool writeBlock();
+};
+
+struct libModbusSystematomSPU_archive_reader_private;
+
+class libModbusSystematomSPU_archive_reader {
+public:
+    libModbusSystematomSPU_archive_reader(std::string path);
+    ~libModbusSystematomSPU_archive_reader();
+
+    bool isOpen();
+    void refresh();                         //See the blocks written since the file was opened
+    uint64_t size();                        //Samples
+    size_t blocks();
+    SPU_ARCHIVE_BLOCK block(size_t i);      //The index
+    uint64_t bytes();                       //Size of the file
+
+    //Decode block i. Returns 1 if it cannot be read or its checksum is wrong.
+    bool decode(size_t i, std::vector<SPU_RECORD>& out);
+
+    //Samples with time in [from, to), oldest first. The blocks overlapping the range are decoded by
+    //`threads` threads (0 = one per CPU).
+    std::vector<SPU_RECORD> query(std::chrono::system_clock::time_point from, std::chrono::system_clock::time_point to,
+                                  unsigned threads = 0);
+
+private:
+    libModbusSystematomSPU_archive_reader_private* _p;
+};
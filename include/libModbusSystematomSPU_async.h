@@ -0,0 +1,78 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <libModbusSystematomSPU.h>
+
+#include <coroutine>
+#include <future>
+
+struct libModbusSystematomSPU_reactor_private;
+
+//One thread (epoll) that drives the serial ports of many libModbusSystematomSPU_async at once.
+//Response timeouts and the silent interval between frames are timerfds, nothing sleeps.
+class libModbusSystematomSPU_reactor {
+public:
+    libModbusSystematomSPU_reactor();
+    ~libModbusSystematomSPU_reactor();
+
+private:
+    libModbusSystematomSPU_reactor_private* _p;
+    friend class libModbusSystematomSPU_async;
+};
+
+struct libModbusSystematomSPU_async_private;
+
+//One SPU read without blocking the caller. Completions run in the reactor thread (keep them short); they may
+//create and destroy devices. A port that hangs up (or does not open) is reopened in the background with backoff,
+//requests made meanwhile complete at once with STATE 2.
+class libModbusSystematomSPU_async {
+public:
+    libModbusSystematomSPU_async(std::shared_ptr<libModbusSystematomSPU_reactor> reactor, std::string portname,
+                                 int slave = 0x01, int baudrate = 57600,
+                                 std::chrono::milliseconds timeout = std::chrono::milliseconds(500));
+    ~libModbusSystematomSPU_async();
+
+    bool isConnected();
+    std::string get_portname();
+
+    //Requests are queued and served in order, the fields of each one merged by the read planner
+    void read_fields(uint32_t fields, std::function<void(const SPU_DATA&)> done);
+    std::future<SPU_DATA> read_fields(uint32_t fields);
+    std::future<SPU_DATA> read_all() { return read_fields(SPU_FIELD_ALL); }
+
+    //co_await spu.co_read_all(): the coroutine resumes in the reactor thread
+    struct awaitable {
+        libModbusSystematomSPU_async* spu;
+        uint32_t fields;
+        SPU_DATA result;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            spu->read_fields(fields, [this, h](const SPU_DATA& data) { result = data; h.resume(); });
+        }
+        SPU_DATA await_resume() { return result; }
+    };
+    awaitable co_read_fields(uint32_t fields) { return awaitable{this, fields, SPU_DATA()}; }
+    awaitable co_read_all()                   { return co_read_fields(SPU_FIELD_ALL); }
+
+private:
+    libModbusSystematomSPU_async_private* _p;
+};
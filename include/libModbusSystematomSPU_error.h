@@ -0,0 +1,78 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
+enum SPU_ERROR_CODE : int
+{
+    SPU_ERROR_CONNECT = 1,      //Failed to connect to Modbus device
+    SPU_ERROR_NO_CONTEXT,       //Modbus context does not exist (STATE 2)
+    SPU_ERROR_READ,             //Failed to read data (STATE 1)
+    SPU_ERROR_SEND,             //Failed to send request
+    SPU_ERROR_AUTOTUNE,         //No baudrate answered
+    SPU_ERROR_JOURNAL,          //Failed to map journal
+    SPU_ERROR_REPLAY,           //Journal is empty or invalid
+    SPU_ERROR_SHM,              //Failed to create shared memory
+    SPU_ERROR_REALTIME,         //Failed to apply a real-time setting
+    SPU_ERROR_ARCHIVE,          //Failed to open, write or decode an archive
+
+    //Not failures: events of background threads, reported here instead of printed on stdout
+    SPU_INFO_CONNECTED = 100,   //The line was opened (or reopened)
+    SPU_INFO_AUTOTUNED,         //autoTune() found a baudrate (get_baudrate(), get_turnaround())
+};
+
+constexpr int SPU_ERROR_PORT_SIZE = 96;
+constexpr int SPU_ERROR_LOG_SIZE  = 256;    //Errors kept by the library (the oldest are overwritten)
+
+//One kind of failure, with the number of times it repeated in a row
+struct SPU_ERROR
+{
+    SPU_ERROR_CODE code      = SPU_ERROR_CONNECT;
+    int            err       = 0;       //errno at the failure (modbus_strerror() knows it)
+    int            slave     = -1;      //-1 = the whole line
+    const char*    className = "";      //Static strings
+    const char*    function  = "";
+    char           port[SPU_ERROR_PORT_SIZE] = {};  //Port name or file path (truncated)
+    std::chrono::system_clock::time_point first;
+    std::chrono::system_clock::time_point last;
+    uint32_t       repeat    = 1;
+};
+
+//Text of the error type
+const char* libModbusSystematomSPU_error_text(SPU_ERROR_CODE code);
+
+//Record an error: it joins a recent identical one (repeat + 1) or takes a new entry of the fixed log.
+//Never allocates; the sink is called for new entries and then at most once per interval while it repeats.
+void libModbusSystematomSPU_report(SPU_ERROR_CODE code, int err, const char* className, const char* function,
+                                   const char* port, int slave = -1);
+
+//Copy the newest (up to max) errors to out, oldest first. Returns how many were copied.
+size_t libModbusSystematomSPU_errors(SPU_ERROR* out, size_t max);
+
+//Replace the sink (nullptr = quiet). It runs in the thread that failed and must not call back into the library.
+void libModbusSystematomSPU_set_error_sink(std::function<void(const SPU_ERROR&)> sink,
+                                           std::chrono::milliseconds interval = std::chrono::milliseconds(1000));
+
+//Default sink: the error on std::cerr, in the message format of the library
+void libModbusSystematomSPU_stderr_sink(const SPU_ERROR& error);
@@ -0,0 +1,80 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <libModbusSystematomSPU.h>
+
+#include <deque>
+
+//Statistics of one float column over a window
+struct SPU_WINDOW_STATS
+{
+    uint64_t count    = 0;
+    float    min      = 0;
+    float    max      = 0;
+    double   mean     = 0;
+    double   variance = 0;  //Population variance
+};
+
+//Last `capacity` good samples (STATE 0) in columns: one float array per float field, one bit array per flag
+//(64 samples per word) and timestamps as 32-bit µs offsets from a per-block base. About 42 bytes per sample.
+//Samples are addressed by an absolute index that keeps growing: [first(), end()) are still held.
+//Columns and flags are named by their SPU_FIELD bit. Not thread-safe: feed it from one consumer
+//(a stream or a sample callback) and query it from that same thread.
+class libModbusSystematomSPU_history {
+public:
+    explicit libModbusSystematomSPU_history(size_t capacity);   //Rounded up to a power of two (at least 64)
+
+    //Store a sample. Returns 1 (and stores nothing) if data.STATE != 0.
+    bool append(const SPU_DATA& data);
+
+    uint64_t first();       //Oldest index held
+    uint64_t end();         //One past the newest
+    size_t   size();
+    size_t   capacity();
+
+    float value(SPU_FIELD column, uint64_t i);
+    bool  flag (SPU_FIELD flag,   uint64_t i);
+    std::chrono::system_clock::time_point time(uint64_t i);
+
+    //First index with time >= t (timestamps are kept non-decreasing)
+    uint64_t lower_bound(std::chrono::system_clock::time_point t);
+
+    //Kernels over the window [begin, end) (clamped to what is held)
+    SPU_WINDOW_STATS stats(SPU_FIELD column, uint64_t begin, uint64_t end);
+    //First i in (begin, end) where the column crosses threshold (rising: value[i-1] < threshold <= value[i]; falling: the
+    //opposite). Returns end if there is none.
+    uint64_t find_crossing(SPU_FIELD column, float threshold, uint64_t begin, uint64_t end, bool rising = true);
+    //Indexes i in (begin, end) where the flag turns on (rising) or off, up to max of them. Returns how many.
+    size_t flag_edges(SPU_FIELD flag, uint64_t begin, uint64_t end, uint64_t* out, size_t max, bool rising = true);
+
+private:
+    struct BLOCK { uint64_t first; int64_t base_ns; }; //Timestamps of samples first.. are offsets from base_ns
+
+    size_t mask;                                        //capacity - 1
+    uint64_t head = 0;                                  //end()
+    int64_t  lastNs = 0;                                //Newest timestamp (keeps them non-decreasing)
+    std::vector<float>    columns[9];                   //SPU_FIELD order
+    std::vector<uint64_t> flags[10];
+    std::vector<uint32_t> offsets;                      //µs from the base of the sample's block
+    std::deque<BLOCK>     blocks;
+
+    size_t window(uint64_t& begin, uint64_t& end);      //Clamp; returns the number of samples
+};
@@ -0,0 +1,77 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <libModbusSystematomSPU.h>
+
+//Journal file: a 4 KiB header followed by SPU_RECORDs in acquisition order. Each record is
+//written in place through mmap and becomes valid only when its commit marker is stored, so a
+//crash leaves at most the record being written behind, which is ignored when the file is opened.
+struct SPU_JOURNAL_HEADER
+{
+    char     magic[8];          //"SPUJRNL1"
+    uint32_t version;
+    uint32_t recordSize;        //sizeof(SPU_RECORD)
+    uint64_t count;             //Committed records at the last flush (hint, the markers are authoritative)
+    int64_t  created_ns;
+};
+
+struct libModbusSystematomSPU_journal_private;
+
+//Append-only writer. Typical use:
+//    spu.add_sample_callback([&](const SPU_DATA& d){ journal.append(d); });
+class libModbusSystematomSPU_journal {
+public:
+    //Open (or create) the file and continue after its last committed record
+    libModbusSystematomSPU_journal(std::string path);
+    ~libModbusSystematomSPU_journal();
+
+    bool isOpen();
+    std::string get_path();
+    uint64_t size();
+
+    bool append(const SPU_DATA& data);  //0 = success
+    void flush();                       //Ask the kernel to write the dirty pages and update the header
+
+private:
+    libModbusSystematomSPU_journal_private* _p;
+    bool resize(uint64_t capacity);
+};
+
+struct libModbusSystematomSPU_journal_reader_private;
+
+class libModbusSystematomSPU_journal_reader {
+public:
+    libModbusSystematomSPU_journal_reader(std::string path);
+    ~libModbusSystematomSPU_journal_reader();
+
+    bool isOpen();
+    uint64_t size();
+    void refresh();                     //See the records appended since the file was opened
+
+    const SPU_RECORD& record(uint64_t index);
+    SPU_DATA at(uint64_t index);
+
+    //Index of the first record at or after time (size() if none), by binary search
+    uint64_t seek(std::chrono::system_clock::time_point time);
+
+private:
+    libModbusSystematomSPU_journal_reader_private* _p;
+};
@@ -0,0 +1,80 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+
+//Bucket k of a histogram counts durations in [2^(k-1), 2^k) µs (bucket 0: under 1 µs), the last one
+//everything longer than 2^22 µs (~4 s)
+constexpr int SPU_HISTOGRAM_BUCKETS = 24;
+
+struct SPU_HISTOGRAM
+{
+    uint64_t count   = 0;
+    uint64_t sum_us  = 0;
+    uint64_t max_us  = 0;
+    uint64_t buckets[SPU_HISTOGRAM_BUCKETS] = {};
+
+    double mean_us() const { return count ? double(sum_us) / count : 0; }
+
+    //Upper bound (µs) of the bucket holding the p-quantile (0 < p <= 1)
+    uint64_t percentile_us(double p) const
+    {
+        uint64_t rank = uint64_t(p * count + 0.5), seen = 0;
+        for (int k = 0; k < SPU_HISTOGRAM_BUCKETS; k++)
+            if ((seen += buckets[k]) >= rank && seen > 0) return k == SPU_HISTOGRAM_BUCKETS - 1 ? max_us : uint64_t(1) << k;
+        return max_us;
+    }
+};
+
+//Fixed-size, lock-free recorder behind SPU_HISTOGRAM: record() is a handful of relaxed atomic adds
+class libModbusSystematomSPU_histogram {
+public:
+    void record(std::chrono::nanoseconds duration)
+    {
+        uint64_t us = duration.count() > 0 ? duration.count() / 1000 : 0;
+        int k = us ? std::bit_width(us) : 0;
+        if (k >= SPU_HISTOGRAM_BUCKETS) k = SPU_HISTOGRAM_BUCKETS - 1;
+        buckets[k].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum_us.fetch_add(us, std::memory_order_relaxed);
+        uint64_t max = max_us.load(std::memory_order_relaxed);
+        while (us > max && !max_us.compare_exchange_weak(max, us, std::memory_order_relaxed));
+    }
+
+    SPU_HISTOGRAM snapshot() const
+    {
+        SPU_HISTOGRAM h;
+        for (int k = 0; k < SPU_HISTOGRAM_BUCKETS; k++) h.buckets[k] = buckets[k].load(std::memory_order_relaxed);
+        h.count  = count.load(std::memory_order_relaxed);
+        h.sum_us = sum_us.load(std::memory_order_relaxed);
+        h.max_us = max_us.load(std::memory_order_relaxed);
+        return h;
+    }
+
+private:
+    std::atomic<uint64_t> buckets[SPU_HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum_us{0};
+    std::atomic<uint64_t> max_us{0};
+};
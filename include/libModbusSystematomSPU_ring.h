@@ -0,0 +1,93 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+//Bounded lock-free ring for one producer thread and one consumer thread.
+//The slots are allocated once in the constructor; push() and pop() never allocate.
+//When the ring is full the producer drops the new value and counts an overrun (it never waits).
+template <typename T>
+class libModbusSystematomSPU_ring
+{
+public:
+    //capacity is rounded up to a power of two
+    explicit libModbusSystematomSPU_ring(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity) size <<= 1;
+        mask = size - 1;
+        slots = std::make_unique<T[]>(size);
+    }
+
+    //Producer side
+    bool push(const T& value)
+    {
+        uint64_t h = head.load(std::memory_order_relaxed);
+        if (h - tailCache > mask)
+        {
+            tailCache = tail.load(std::memory_order_acquire);
+            if (h - tailCache > mask)
+            {
+                lost.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+        }
+        slots[h & mask] = value;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    //Consumer side: copy up to max values to out, oldest first
+    size_t pop(T* out, size_t max)
+    {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        uint64_t h = head.load(std::memory_order_acquire);
+        size_t n = h - t < max ? h - t : max;
+        for (size_t i = 0; i < n; i++) out[i] = slots[(t + i) & mask];
+        tail.store(t + n, std::memory_order_release);
+        return n;
+    }
+
+    bool pop(T& out) { return pop(&out, 1) == 1; }
+
+    //Consumer side: look at the oldest value without removing it (nullptr if empty)
+    const T* front()
+    {
+        uint64_t t = tail.load(std::memory_order_relaxed);
+        return t == head.load(std::memory_order_acquire) ? nullptr : &slots[t & mask];
+    }
+    void drop() { tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    size_t   size()      const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+    size_t   capacity()  const { return mask + 1; }
+    uint64_t overruns()  const { return lost.load(std::memory_order_relaxed); }
+
+private:
+    std::unique_ptr<T[]> slots;
+    uint64_t mask;
+    alignas(64) std::atomic<uint64_t> head{0};  //Written by the producer
+    uint64_t tailCache = 0;                     //Producer's copy of tail
+    std::atomic<uint64_t> lost{0};
+    alignas(64) std::atomic<uint64_t> tail{0};  //Written by the consumer
+};
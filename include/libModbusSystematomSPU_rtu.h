@@ -0,0 +1,61 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+//MODBUS-RTU framing of the only request the SPU needs: read holding registers (0x03)
+
+constexpr int SPU_RTU_REQUEST_SIZE   = 8;   //slave, function, address (2), count (2), CRC (2)
+constexpr int SPU_RTU_EXCEPTION_SIZE = 5;   //slave, function | 0x80, code, CRC (2)
+constexpr int SPU_RTU_MAX_FRAME_SIZE = 256;
+
+//Length of the answer to a read of num_registers
+constexpr int libModbusSystematomSPU_rtu_response_size(int num_registers) { return 5 + 2 * num_registers; }
+
+//Open a serial port in raw 8N1 mode at baudrate. Returns the file descriptor or -1 (errno set).
+int libModbusSystematomSPU_rtu_open(const char* portname, int baudrate, bool nonblocking);
+
+//Set ASYNC_LOW_LATENCY on a serial port (USB adapters then deliver each byte at once instead of
+//batching them for up to 16 ms). Returns -1 (errno set) where the driver does not support it.
+int libModbusSystematomSPU_rtu_low_latency(int fd);
+
+//CRC16 of MODBUS-RTU (polynomial 0xA001, initial value 0xFFFF), sent low byte first
+uint16_t libModbusSystematomSPU_crc16(const uint8_t* data, size_t len);
+
+//Write the request to frame and return its length
+int libModbusSystematomSPU_rtu_request(uint8_t* frame, int slave, int start_address, int num_registers);
+
+//Bytes still missing before the answer in frame[0..len) is complete (0 = complete).
+//An exception answer is recognised as soon as its function byte arrives.
+int libModbusSystematomSPU_rtu_missing(const uint8_t* frame, int len, int num_registers);
+
+//Check a complete answer and copy its registers to dest. Returns num_registers, or -1 with errno
+//set like libmodbus does (EMBBADCRC, EMBBADSLAVE, EMBBADDATA or MODBUS_ENOBASE + exception code).
+int libModbusSystematomSPU_rtu_response(const uint8_t* frame, int len, int slave, int num_registers, uint16_t* dest);
+
+//One blocking transaction on a port opened by libModbusSystematomSPU_rtu_open(): send the prebuilt request,
+//read the answer until its expected length and decode it to dest. Same return and errno as
+//libModbusSystematomSPU_rtu_response(), ETIMEDOUT when the first byte took longer than responseTimeout
+//or a later one longer than byteTimeout (as libmodbus). Never allocates.
+int libModbusSystematomSPU_rtu_transact(int fd, const uint8_t* request, int num_registers, uint16_t* dest,
+                                        std::chrono::microseconds responseTimeout, std::chrono::microseconds byteTimeout);
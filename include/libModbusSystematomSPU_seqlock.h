@@ -0,0 +1,80 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+//Single writer, many readers. The writer never waits; a reader only retries if it overlaps a store.
+//The value is kept in atomic words so the class is standard layout and can live in shared memory.
+template <typename T>
+class libModbusSystematomSPU_seqlock
+{
+    static_assert(std::is_trivially_copyable_v<T>, "seqlock values are copied word by word");
+    static constexpr std::size_t WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+public:
+    void store(const T& value)
+    {
+        uint64_t buffer[WORDS] = {};
+        std::memcpy(buffer, &value, sizeof(T));
+
+        uint64_t s = seq.load(std::memory_order_relaxed);
+        seq.store(s + 1, std::memory_order_relaxed);        //Odd: store in progress
+        std::atomic_thread_fence(std::memory_order_release);
+        for (std::size_t i = 0; i < WORDS; i++) words[i].store(buffer[i], std::memory_order_relaxed);
+        seq.store(s + 2, std::memory_order_release);        //Even: value complete
+    }
+
+    //Copy the newest value to out and return how many stores were made (0 = nothing stored yet)
+    uint64_t load(T& out) const
+    {
+        uint64_t stores;
+        while (try_load(out, stores, 1024));
+        return stores;
+    }
+
+    //load() that gives up after `attempts` overlapping stores (a writer in another process may die in the
+    //middle of one). Returns 0 with out and stores set, 1 with both untouched.
+    bool try_load(T& out, uint64_t& stores, unsigned attempts) const
+    {
+        uint64_t buffer[WORDS];
+        for (unsigned a = 0; a < attempts; a++)
+        {
+            uint64_t s0 = seq.load(std::memory_order_acquire);
+            if (s0 & 1) continue;
+            for (std::size_t i = 0; i < WORDS; i++) buffer[i] = words[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq.load(std::memory_order_relaxed) != s0) continue;
+            std::memcpy(&out, buffer, sizeof(T));
+            stores = s0 / 2;
+            return 0;
+        }
+        return 1;
+    }
+
+    uint64_t version() const { return seq.load(std::memory_order_acquire) / 2; }
+
+private:
+    std::atomic<uint64_t> seq{0};
+    std::atomic<uint64_t> words[WORDS] = {};
+};
@@ -0,0 +1,210 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <libModbusSystematomSPU.h>
+#include <libModbusSystematomSPU_seqlock.h>
+
+#include <cerrno>
+#include <csignal>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//Shared memory segment (shm_open name like "/spu0"): a header, the newest sample behind a seqlock and a
+//ring of the last `capacity` samples, each slot a seqlock of its own tagged with the sample index.
+//The writer never waits for a reader; a reader that falls more than `capacity` samples behind loses the oldest.
+constexpr char     SPU_SHM_MAGIC[8] = {'S','P','U','S','H','M','0','1'};
+constexpr uint32_t SPU_SHM_VERSION  = 1;
+constexpr std::chrono::milliseconds SPU_SHM_READ_TIMEOUT{100};  //Longest a reader waits for a store in progress
+
+struct SPU_SHM_HEADER
+{
+    char     magic[8];          //SPU_SHM_MAGIC, written last by the publisher
+    uint32_t version;
+    uint32_t recordSize;        //sizeof(SPU_RECORD)
+    uint64_t capacity;          //Slots of the ring (power of two)
+    int64_t  created_ns;
+    int32_t  writerPid;
+};
+
+struct SPU_SHM_ENTRY
+{
+    uint64_t   index;           //Sample number (0 = the first one published)
+    SPU_RECORD record;
+};
+
+struct SPU_SHM_SEGMENT
+{
+    SPU_SHM_HEADER header;
+    alignas(64) libModbusSystematomSPU_seqlock<SPU_RECORD> latest;
+    alignas(64) std::atomic<uint64_t> head;         //Samples ever published
+    //capacity x libModbusSystematomSPU_seqlock<SPU_SHM_ENTRY> follow, from offset SPU_SHM_RING_OFFSET
+};
+
+using SPU_SHM_SLOT = libModbusSystematomSPU_seqlock<SPU_SHM_ENTRY>;
+constexpr size_t SPU_SHM_RING_OFFSET = (sizeof(SPU_SHM_SEGMENT) + 63) / 64 * 64;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the segment is shared between processes");
+static_assert(std::is_standard_layout_v<SPU_SHM_SEGMENT> && std::is_standard_layout_v<SPU_SHM_SLOT>, "SPU_SHM_SEGMENT is a shared layout");
+
+constexpr size_t libModbusSystematomSPU_shm_size(uint64_t capacity) { return SPU_SHM_RING_OFFSET + capacity * sizeof(SPU_SHM_SLOT); }
+
+struct libModbusSystematomSPU_shm_private;
+
+//Writer side (one per segment). Typical use:
+//    spu.add_sample_callback([&](const SPU_DATA& d){ shm.publish(d); });
+class libModbusSystematomSPU_shm {
+public:
+    //Create (or replace) the segment; it is removed again by the destructor
+    libModbusSystematomSPU_shm(std::string name, size_t capacity = 4096);
+    ~libModbusSystematomSPU_shm();
+
+    bool isOpen();
+    std::string get_name();
+
+    //Store the sample as the newest one and append it to the ring: a few relaxed stores, no system call
+    void publish(const SPU_DATA& data);
+
+private:
+    libModbusSystematomSPU_shm_private* _p;
+};
+
+//Reader side, header-only: needs no library and makes no system call after the constructor (but while it
+//waits for a store in progress).
+//Every read copies one 64-byte SPU_RECORD out of the segment (libModbusSystematomSPU_unpack() turns it into
+//SPU_DATA). If the publisher restarts, open the segment again. A publisher that died in the middle of a
+//store leaves that slot unreadable: reads of it fail instead of waiting for ever (see writerAlive()).
+class libModbusSystematomSPU_shm_reader {
+public:
+    explicit libModbusSystematomSPU_shm_reader(const std::string& name)
+    {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        struct stat st;
+        if (fd < 0) return;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)SPU_SHM_RING_OFFSET)
+        {
+            void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                this->segment = static_cast<const SPU_SHM_SEGMENT*>(map);
+                this->size = st.st_size;
+                const SPU_SHM_HEADER& h = this->segment->header;
+                if (std::memcmp(h.magic, SPU_SHM_MAGIC, sizeof(SPU_SHM_MAGIC)) != 0 || h.version != SPU_SHM_VERSION ||
+                    h.recordSize != sizeof(SPU_RECORD) || libModbusSystematomSPU_shm_size(h.capacity) > this->size)
+                {
+                    munmap(map, this->size);
+                    this->segment = nullptr;
+                }
+            }
+        }
+        close(fd);
+        if (this->segment)
+        {
+            this->ring   = reinterpret_cast<const SPU_SHM_SLOT*>(reinterpret_cast<const uint8_t*>(this->segment) + SPU_SHM_RING_OFFSET);
+            this->mask   = this->segment->header.capacity - 1;
+            this->cursor = head();
+        }
+    }
+    ~libModbusSystematomSPU_shm_reader() { if (this->segment) munmap(const_cast<SPU_SHM_SEGMENT*>(this->segment), this->size); }
+
+    libModbusSystematomSPU_shm_reader(const libModbusSystematomSPU_shm_reader&) = delete;
+    libModbusSystematomSPU_shm_reader& operator=(const libModbusSystematomSPU_shm_reader&) = delete;
+
+    bool     isOpen()   const { return this->segment != nullptr; }
+    uint64_t capacity() const { return this->mask + 1; }
+    uint64_t head()     const { return this->segment->head.load(std::memory_order_acquire); }  //Samples ever published
+
+    //The publishing process still exists (same PID namespace)
+    bool writerAlive() const { return kill(this->segment->header.writerPid, 0) == 0 || errno == EPERM; }
+
+    //Newest sample; returns how many were published (0 = none yet or the publisher died while storing it,
+    //out untouched)
+    uint64_t latest(SPU_RECORD& out) const
+    {
+        SPU_RECORD r;
+        uint64_t n;
+        if (load(this->segment->latest, r, n)) return 0;
+        if (n) out = r;
+        return n;
+    }
+
+    //Sample number index, if it is still in the ring. Returns 1 if it was overwritten, is not published yet or
+    //cannot be read (publisher died while storing it).
+    bool read(uint64_t index, SPU_RECORD& out) const
+    {
+        SPU_SHM_ENTRY e;
+        uint64_t stores;
+        if (load(this->ring[index & this->mask], e, stores)) return 1;
+        if (e.index != index || index >= head()) return 1;
+        out = e.record;
+        return 0;
+    }
+
+    //Tail the ring: the next sample after the previous call (the first call starts at the samples published
+    //after the constructor). Returns false when there is nothing new. Samples overwritten before being read
+    //are skipped and counted by lost().
+    bool next(SPU_RECORD& out)
+    {
+        for (;;)
+        {
+            uint64_t h = head();
+            if (this->cursor >= h) return false;
+            if (h - this->cursor > capacity())
+            {
+                this->skipped += h - capacity() - this->cursor;
+                this->cursor = h - capacity();
+            }
+            if (read(this->cursor, out) == 0) { this->cursor++; return true; }
+            this->skipped++;    //Overwritten while we looked at it
+            this->cursor++;
+        }
+    }
+
+    void     seek(uint64_t index) { this->cursor = index; }
+    uint64_t position() const     { return this->cursor; }
+    uint64_t lost() const         { return this->skipped; }
+
+private:
+    const SPU_SHM_SEGMENT* segment = nullptr;
+
+    //Bounded seqlock read: a store in progress is waited for up to SPU_SHM_READ_TIMEOUT, unless its writer is gone
+    template <typename T>
+    bool load(const libModbusSystematomSPU_seqlock<T>& slot, T& out, uint64_t& stores) const
+    {
+        if (slot.try_load(out, stores, 1024) == 0) return 0;
+        auto until = std::chrono::steady_clock::now() + SPU_SHM_READ_TIMEOUT;
+        while (writerAlive() && std::chrono::steady_clock::now() < until)
+        {
+            sched_yield();
+            if (slot.try_load(out, stores, 1024) == 0) return 0;
+        }
+        return 1;
+    }
+
+    const SPU_SHM_SLOT*    ring    = nullptr;
+    size_t   size    = 0;
+    uint64_t mask    = 0;
+    uint64_t cursor  = 0;
+    uint64_t skipped = 0;
+};
@@ -0,0 +1,254 @@
+/*
+This is a simulator of the SystemAtom SPU for libModbusSystematomSPU, a library
+to communicate with the SystemAtom SPU using MODBUS-RTU (RS-485) on a GNU
+operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "spuSimulator.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <thread>
+
+#ifndef SPU_BENCH_BUILD_TYPE
+#define SPU_BENCH_BUILD_TYPE ""
+#endif
+
+//One line of the report: either a batch (only the mean is known) or per-operation latencies
+struct SPU_BENCH_RESULT
+{
+    std::string name;
+    uint64_t    iterations = 0;
+    uint64_t    failures   = 0;
+    double      seconds    = 0;
+    std::vector<double> latencies_us;   //Sorted; empty for batches
+    SPU_HISTOGRAM histogram;            //Used instead of latencies_us when count > 0
+};
+
+static std::vector<SPU_BENCH_RESULT> results;
+static std::string filter;
+
+//Keep the compiler from dropping the work of a benchmark loop
+template <typename T>
+static inline void keep(T& value) { asm volatile("" : : "g"(&value) : "memory"); }
+
+static bool selected(const std::string& name) { return filter.empty() || name.find(filter) != std::string::npos; }
+
+//Time `iterations` calls as one batch (for operations far shorter than a clock read)
+static void batch(const std::string& name, uint64_t iterations, const std::function<void()>& f)
+{
+    if (!selected(name)) return;
+    for (uint64_t i = 0; i < iterations / 10 + 1; i++) f();
+    SPU_BENCH_RESULT r;
+    r.name = name;
+    r.iterations = iterations;
+    auto t0 = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; i++) f();
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    results.push_back(r);
+    std::fprintf(stderr, "%-28s %12.1f ns/op\n", name.c_str(), r.seconds * 1e9 / iterations);
+}
+
+//Time each call (f returns true on failure)
+static void cycles(const std::string& name, uint64_t iterations, const std::function<bool()>& f)
+{
+    if (!selected(name)) return;
+    for (int i = 0; i < 10; i++) f();
+    SPU_BENCH_RESULT r;
+    r.name = name;
+    r.iterations = iterations;
+    r.latencies_us.reserve(iterations);
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; i++)
+    {
+        auto t0 = std::chrono::steady_clock::now();
+        if (f()) r.failures++;
+        r.latencies_us.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - t0).count());
+    }
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::sort(r.latencies_us.begin(), r.latencies_us.end());
+    results.push_back(r);
+    std::fprintf(stderr, "%-28s %12.1f us/op  p50 %.1f  p99 %.1f us  (%llu failed)\n", name.c_str(), r.seconds * 1e6 / iterations,
+                 r.latencies_us[iterations / 2], r.latencies_us[std::min<uint64_t>(iterations - 1, iterations * 99 / 100)],
+                 (unsigned long long)r.failures);
+}
+
+static double percentile(const SPU_BENCH_RESULT& r, double p)
+{
+    if (r.histogram.count) return r.histogram.percentile_us(p);
+    if (r.latencies_us.empty()) return 0;
+    return r.latencies_us[std::min<size_t>(r.latencies_us.size() - 1, size_t(p * r.latencies_us.size()))];
+}
+
+static void printJson(FILE* out, const std::string& port, int baudrate, bool nativeRtu)
+{
+    std::fprintf(out, "{\n  \"benchmark\": \"modbussystematomspu-bench\",\n");
+    std::fprintf(out, "  \"build_type\": \"%s\",\n  \"port\": \"%s\",\n  \"baudrate\": %d,\n  \"native_rtu\": %s,\n",
+                 SPU_BENCH_BUILD_TYPE, port.c_str(), baudrate, nativeRtu ? "true" : "false");
+    std::fprintf(out, "  \"results\": [");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const SPU_BENCH_RESULT& r = results[i];
+        std::fprintf(out, "%s\n    {\"name\": \"%s\", \"iterations\": %llu, \"failures\": %llu, \"seconds\": %.6f, "
+                          "\"ns_per_op\": %.2f, \"ops_per_second\": %.1f",
+                     i ? "," : "", r.name.c_str(), (unsigned long long)r.iterations, (unsigned long long)r.failures, r.seconds,
+                     r.seconds * 1e9 / r.iterations, r.iterations / r.seconds);
+        if (!r.latencies_us.empty() || r.histogram.count)
+            std::fprintf(out, ", \"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f",
+                         percentile(r, 0.5), percentile(r, 0.9), percentile(r, 0.99),
+                         r.histogram.count ? double(r.histogram.max_us) : r.latencies_us.back());
+        std::fprintf(out, "}");
+    }
+    std::fprintf(out, "\n  ]\n}\n");
+}
+
+static void usage(const char* name)
+{
+    std::cerr << "Usage: " << name << " [options]\n"
+              << "  --port <name>             benchmark this port instead of the built-in simulated SPU\n"
+              << "  --baud <rate>             baudrate (and pacing of the simulated SPU; 0 = no pacing, default 0)\n"
+              << "  --libmodbus               use libmodbus instead of the built-in RTU engine\n"
+              << "  --iterations <n>          cycles of each bus benchmark (default 2000)\n"
+              << "  --duration <s>            length of the polling benchmark (default 5)\n"
+              << "  --filter <text>           run only the benchmarks whose name contains text\n"
+              << "  --out <file>              write the JSON report to file instead of stdout\n";
+}
+
+int main(int argc, char* argv[])
+{
+    std::string port, outPath;
+    int baudrate = 0;
+    bool nativeRtu = true;
+    uint64_t iterations = 2000;
+    double duration = 5;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string opt = argv[i];
+        if (opt == "--libmodbus") { nativeRtu = false; continue; }
+        if (i + 1 >= argc) { usage(argv[0]); return 1; }
+        std::string val = argv[++i];
+        try
+        {
+            if      (opt == "--port")       port = val;
+            else if (opt == "--baud")       baudrate = std::stoi(val);
+            else if (opt == "--iterations") iterations = std::stoull(val);
+            else if (opt == "--duration")   duration = std::stod(val);
+            else if (opt == "--filter")     filter = val;
+            else if (opt == "--out")        outPath = val;
+            else { usage(argv[0]); return 1; }
+        }
+        catch (std::exception&) { usage(argv[0]); return 1; }
+    }
+    if (iterations == 0) iterations = 1;
+    // The report owns stdout: messages of the library go to stderr
+    std::streambuf* coutBuffer = std::cout.rdbuf(std::cerr.rdbuf());
+
+    //////// Offline: register map and planner ////////
+
+    uint16_t regs[SPU_REGISTER_IMAGE_SIZE] = {};
+    SPU_DATA data;
+    {
+        SPU_SIM_CONFIG sc;
+        sc.waves[0] = {SPU_SIM_WAVE::SINE, 100, 10, 10};
+        spuSimulator(sc).image(1, 0.25, regs);
+    }
+    uint64_t micro = iterations * 1000;
+    batch("decode_all",  micro, [&]{ regs[1]++; libModbusSystematomSPU_decode(regs, data); keep(data); });
+    batch("decode_nt",   micro, [&]{ regs[1]++; libModbusSystematomSPU_decode(regs, data, SPU_FIELD_NT); keep(data); });
+    batch("decode_bool", micro, [&]{ regs[0x64]++; libModbusSystematomSPU_decode(regs, data, SPU_FIELD_BOOL); keep(data); });
+    batch("encode_all",  micro, [&]{ data.N_DATA_FP++; libModbusSystematomSPU_encode(data, regs); keep(regs); });
+    SPU_RECORD record;
+    batch("pack",        micro, [&]{ data.SEQ++; record = libModbusSystematomSPU_pack(data); keep(record); });
+    batch("unpack",      micro, [&]{ record.seq++; data = libModbusSystematomSPU_unpack(record); keep(data); });
+    SPU_READ_COST cost = libModbusSystematomSPU_cost(57600, 1000);
+    SPU_READ_PLAN plan;
+    uint32_t fields = 0;
+    batch("plan",        iterations * 100, [&]{ fields = (fields + 0x9E37) & SPU_FIELD_ALL; plan = libModbusSystematomSPU_plan(fields, cost); keep(plan); });
+
+    //////// Over a line: the built-in simulated SPU on a pseudo-terminal, or --port ////////
+
+    std::atomic<bool> running{true};
+    std::unique_ptr<spuSimulator> sim;
+    std::thread server;
+    if (port.empty())
+    {
+        SPU_SIM_CONFIG sc;
+        sc.baudrate = baudrate;
+        sc.waves[0]  = {SPU_SIM_WAVE::SINE, 100, 10, 10};
+        sc.waves[1]  = {SPU_SIM_WAVE::SINE,  50,  5, 60};
+        sc.waves[16] = {SPU_SIM_WAVE::CONST,  1,  0,  1};
+        sim = std::make_unique<spuSimulator>(sc);
+        port = sim->openPty();
+        if (port.empty()) { std::cerr << "Failed to create a pseudo-terminal" << std::endl; return 2; }
+        server = std::thread([&]{ sim->runRtu(running); });
+    }
+
+    SPU_CONFIG config;
+    config.nativeRtu = nativeRtu;
+    if (baudrate > 0) config.baudrate = baudrate;
+    libModbusSystematomSPU_set_error_sink(nullptr);
+    {
+        libModbusSystematomSPU spu(port, config);
+        if (spu.get_all().STATE == 0)
+        {
+            cycles("get_all",             iterations, [&]{ return spu.get_all().STATE != 0; });
+            cycles("get_all_update_NT",   iterations, [&]{ return spu.get_all_update_NT().STATE != 0; });
+            cycles("get_all_update_bool", iterations, [&]{ return spu.get_all_update_bool().STATE != 0; });
+            cycles("get_fields_nt_rdy",   iterations, [&]{ return spu.get_fields(SPU_FIELD_NT | SPU_FIELD_RDY).STATE != 0; });
+            cycles("get_N_DATA_FP",       iterations, [&]{ return spu.get_N_DATA_FP() == -1; });
+            cycles("get_EMR_N_THRESHOLD", iterations, [&]{ return spu.get_EMR_N_THRESHOLD() == -1; });
+            cycles("get_RDY",             iterations, [&]{ bool v = spu.get_RDY(); keep(v); return false; });  // A failed flag reads as set
+
+            // End to end: the multi-rate polling thread for `duration` seconds
+            if (selected("poll_default_schedule"))
+            {
+                std::atomic<uint64_t> good{0}, bad{0};
+                spu.add_sample_callback([&](const SPU_DATA& d){ (d.STATE == 0 ? good : bad)++; });
+                SPU_METRICS before = spu.get_metrics();
+                auto t0 = std::chrono::steady_clock::now();
+                spu.startPolling(libModbusSystematomSPU_default_schedule(spu.get_read_cost()));
+                std::this_thread::sleep_for(std::chrono::duration<double>(duration));
+                spu.stopPolling();
+                SPU_BENCH_RESULT r;
+                r.name       = "poll_default_schedule";
+                r.seconds    = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+                r.iterations = good + bad;
+                r.failures   = bad;
+                r.histogram  = spu.get_metrics().paths[SPU_PATH_POLL];
+                for (int k = 0; k < SPU_HISTOGRAM_BUCKETS; k++) r.histogram.buckets[k] -= before.paths[SPU_PATH_POLL].buckets[k];
+                r.histogram.count  -= before.paths[SPU_PATH_POLL].count;
+                r.histogram.sum_us -= before.paths[SPU_PATH_POLL].sum_us;
+                if (r.iterations == 0) r.iterations = 1;
+                results.push_back(r);
+                std::fprintf(stderr, "%-28s %12.1f samples/s  p50 <= %llu  p99 <= %llu us  (%llu failed)\n", r.name.c_str(),
+                             good / r.seconds, (unsigned long long)r.histogram.percentile_us(0.5),
+                             (unsigned long long)r.histogram.percentile_us(0.99), (unsigned long long)r.failures);
+            }
+        }
+        else std::cerr << "No answer from " << port << ": bus benchmarks skipped" << std::endl;
+    }
+
+    running = false;
+    if (server.joinable()) server.join();
+
+    std::cout.rdbuf(coutBuffer);
+    FILE* out = outPath.empty() ? stdout : std::fopen(outPath.c_str(), "w");
+    if (!out) { std::cerr << "Failed to open " << outPath << std::endl; return 2; }
+    printJson(out, sim ? "simulator" : port, baudrate, nativeRtu);
+    if (out != stdout) std::fclose(out);
+    return 0;
+}
@@ -0,0 +1,327 @@
+/*
+This is a simulator of the SystemAtom SPU for libModbusSystematomSPU, a library
+to communicate with the SystemAtom SPU using MODBUS-RTU (RS-485) on a GNU
+operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <libModbusSystematomSPU.h>
+#include <libModbusSystematomSPU_seqlock.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+
+static std::atomic<bool> running{true};
+
+constexpr int MBAP_HEADER_SIZE = 7;     //Transaction, protocol, length, unit
+constexpr int TCP_MAX_ADU_SIZE = 260;
+constexpr int MAX_EVENTS       = 64;
+constexpr size_t MAX_PENDING_OUTPUT = 4096;    //Answers held for a client that does not read them, before its requests wait
+
+//Register image of the SPU as of the newest good sample, shared by the polling thread and the server
+struct SPU_GATEWAY_IMAGE
+{
+    int64_t  time_ns = 0;               //TIME of the sample (0 = no good sample yet)
+    uint16_t regs[SPU_REGISTER_IMAGE_SIZE] = {};
+};
+
+struct SPU_GATEWAY_CLIENT
+{
+    uint8_t in[TCP_MAX_ADU_SIZE];
+    int     inLen = 0;
+    std::vector<uint8_t> out;           //Answers the socket did not take yet
+    uint32_t events = EPOLLIN;          //Registered with epoll: no EPOLLIN while out is full, EPOLLOUT while not empty
+};
+
+struct SPU_GATEWAY_STATS
+{
+    uint64_t accepted   = 0;
+    uint64_t requests   = 0;
+    uint64_t exceptions = 0;
+    uint64_t protocolErrors = 0;        //Clients dropped for malformed frames
+};
+
+static void usage(const char* name)
+{
+    std::cerr << "Usage: " << name << " <serial_port_name> [options]\n"
+              << "  --tcp <port>              serve Modbus TCP on <port> (default 1502)\n"
+              << "  --bind <address>          address to listen on (default 127.0.0.1)\n"
+              << "  --slave <id>              slave ID of the SPU on the line (default 1)\n"
+              << "  --unit <id>               unit ID answered over TCP (default: any)\n"
+              << "  --baud <rate>             baudrate of the line (default 57600)\n"
+              << "  --native                  use the built-in RTU engine\n"
+              << "  --period <us>             poll every field together every <us> instead of the default schedule\n"
+              << "  --max-age <ms>            answer exception 0x0B when the image is older (default 1000)\n"
+              << "  --stats <s>               print the statistics every <s> seconds\n";
+}
+
+static int listenTcp(const std::string& address, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int yes = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port   = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1 ||
+        bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//Answer the request (PDU of len bytes) from image; returns the size of the response PDU written to rsp
+static int answer(const uint8_t* pdu, int len, const SPU_GATEWAY_IMAGE& image, bool stale, uint8_t* rsp)
+{
+    int function = pdu[0];
+    int exception = 0;
+    if (function != 0x03 && function != 0x04)  exception = 0x01;  //Illegal function
+    else if (len != 5)                          exception = 0x03;  //Illegal data value
+    else
+    {
+        int address   = pdu[1] << 8 | pdu[2];
+        int registers = pdu[3] << 8 | pdu[4];
+        if (registers < 1 || registers > SPU_MAX_READ_REGISTERS)   exception = 0x03;
+        else if (address + registers > SPU_REGISTER_IMAGE_SIZE)    exception = 0x02;  //Illegal data address
+        else if (stale)                                            exception = 0x0B;  //Gateway target failed to respond
+        else
+        {
+            rsp[0] = function;
+            rsp[1] = 2 * registers;
+            for (int i = 0; i < registers; i++)
+            {
+                rsp[2 + 2*i] = image.regs[address + i] >> 8;
+                rsp[3 + 2*i] = image.regs[address + i] & 0xFF;
+            }
+            return 2 + 2 * registers;
+        }
+    }
+    rsp[0] = function | 0x80;
+    rsp[1] = exception;
+    return 2;
+}
+
+int main(int argc, char* argv[])
+{
+    libModbusSystematomSPU_license();
+    if (argc < 2 || argv[1][0] == '-') { usage(argv[0]); return 1; }
+
+    std::string portname = argv[1];
+    std::string address = "127.0.0.1";
+    int tcpPort = 1502;
+    int slave = 1;
+    int unit = -1;
+    long period = -1;
+    int statsEvery = 0;
+    std::chrono::milliseconds maxAge(1000);
+    SPU_CONFIG config;
+    for (int i = 2; i < argc; i++)
+    {
+        std::string opt = argv[i];
+        if (opt == "--native") { config.nativeRtu = true; continue; }
+        if (i + 1 >= argc) { usage(argv[0]); return 1; }
+        std::string val = argv[++i];
+        try
+        {
+            if      (opt == "--tcp")     tcpPort = std::stoi(val);
+            else if (opt == "--bind")    address = val;
+            else if (opt == "--slave")   slave = std::stoi(val, nullptr, 0);
+            else if (opt == "--unit")    unit = std::stoi(val, nullptr, 0);
+            else if (opt == "--baud")    config.baudrate = std::stoi(val);
+            else if (opt == "--period")  period = std::stol(val);
+            else if (opt == "--max-age") maxAge = std::chrono::milliseconds(std::stol(val));
+            else if (opt == "--stats")   statsEvery = std::stoi(val);
+            else { usage(argv[0]); return 1; }
+        }
+        catch (std::exception&) { usage(argv[0]); return 1; }
+    }
+
+    std::signal(SIGINT,  [](int){ running = false; });
+    std::signal(SIGTERM, [](int){ running = false; });
+    std::signal(SIGPIPE, SIG_IGN);
+
+    int server = listenTcp(address, tcpPort);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (server < 0 || epfd < 0)
+    {
+        std::cerr << "ERROR in gateway at " << address << ":" << tcpPort << "\n\tError code: " << std::strerror(errno) << std::endl;
+        return 2;
+    }
+    epoll_event ev = {};
+    ev.events  = EPOLLIN;
+    ev.data.fd = server;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, server, &ev);
+
+    // The only owner of the serial port: every TCP client is served from this image
+    config.backgroundConnect = true;
+    auto bus = std::make_shared<libModbusSystematomSPU_bus>(portname, config);
+    libModbusSystematomSPU spu(bus, slave);
+    libModbusSystematomSPU_seqlock<SPU_GATEWAY_IMAGE> shared;
+    spu.add_sample_callback([&shared](const SPU_DATA& data) {
+        if (data.STATE != 0) return;
+        SPU_GATEWAY_IMAGE image;
+        image.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(data.TIME.time_since_epoch()).count();
+        libModbusSystematomSPU_encode(data, image.regs);
+        shared.store(image);
+    });
+    if (period >= 0) spu.startPolling(std::chrono::microseconds(period));
+    else             spu.startPolling(libModbusSystematomSPU_default_schedule(spu.get_read_cost()));
+    std::cout << "Serving " << portname << " (slave " << slave << ") at: tcp://" << address << ":" << tcpPort << std::endl;
+
+    std::unordered_map<int, SPU_GATEWAY_CLIENT> clients;
+    SPU_GATEWAY_STATS stats;
+    SPU_GATEWAY_IMAGE image;
+    uint64_t version = 0;
+
+    auto drop = [&](int fd) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        clients.erase(fd);
+    };
+    // Send what the socket takes; keep the rest and wait for EPOLLOUT. A client that does not read its answers
+    // is not read either until they drain, so it cannot make the gateway hold an unbounded backlog.
+    auto flush = [&](int fd, SPU_GATEWAY_CLIENT& c) {
+        size_t sent = 0;
+        while (sent < c.out.size())
+        {
+            ssize_t n = send(fd, c.out.data() + sent, c.out.size() - sent, MSG_NOSIGNAL);
+            if (n < 0) { if (errno == EINTR) continue; if (errno == EAGAIN) break; return false; }
+            sent += n;
+        }
+        c.out.erase(c.out.begin(), c.out.begin() + sent);
+        uint32_t events = (c.out.size() < MAX_PENDING_OUTPUT ? uint32_t(EPOLLIN) : 0u) | (c.out.empty() ? 0u : uint32_t(EPOLLOUT));
+        if (c.events != events)
+        {
+            c.events = events;
+            epoll_event e = {};
+            e.events  = events;
+            e.data.fd = fd;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &e);
+        }
+        return true;
+    };
+
+    auto printStats = [&]{
+        std::cout << "clients=" << clients.size() << " accepted=" << stats.accepted << " requests=" << stats.requests
+                  << " exceptions=" << stats.exceptions << " protocol_errors=" << stats.protocolErrors
+                  << " samples=" << shared.version() << std::endl;
+    };
+    auto nextStats = std::chrono::steady_clock::now() + std::chrono::seconds(statsEvery);
+
+    epoll_event events[MAX_EVENTS];
+    while (running)
+    {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+        if (statsEvery > 0 && std::chrono::steady_clock::now() >= nextStats)
+        {
+            printStats();
+            nextStats += std::chrono::seconds(statsEvery);
+        }
+        if (n <= 0) continue;
+
+        // One snapshot of the image serves every request of this batch
+        if (shared.version() != version) version = shared.load(image);
+        int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        bool stale = image.time_ns == 0 || now - image.time_ns > std::chrono::duration_cast<std::chrono::nanoseconds>(maxAge).count();
+
+        for (int k = 0; k < n; k++)
+        {
+            int fd = events[k].data.fd;
+            if (fd == server)
+            {
+                int client;
+                while ((client = accept4(server, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    int yes = 1;
+                    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+                    epoll_event e = {};
+                    e.events  = EPOLLIN;
+                    e.data.fd = client;
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, client, &e);
+                    clients[client];
+                    stats.accepted++;
+                }
+                continue;
+            }
+
+            auto it = clients.find(fd);
+            if (it == clients.end()) continue;
+            SPU_GATEWAY_CLIENT& c = it->second;
+            if (events[k].events & (EPOLLERR | EPOLLHUP)) { drop(fd); continue; }
+            if ((events[k].events & EPOLLOUT) && !flush(fd, c)) { drop(fd); continue; }
+            if (!(events[k].events & EPOLLIN)) continue;
+
+            bool alive = true;
+            while (alive && c.out.size() < MAX_PENDING_OUTPUT)
+            {
+                ssize_t r = recv(fd, c.in + c.inLen, sizeof(c.in) - c.inLen, 0);
+                if (r < 0 && errno == EINTR) continue;
+                if (r < 0 && errno == EAGAIN) break;
+                if (r <= 0) { alive = false; break; }
+                c.inLen += r;
+
+                // Every complete frame in the buffer (clients may pipeline requests)
+                int used = 0;
+                while (c.inLen - used >= MBAP_HEADER_SIZE)
+                {
+                    const uint8_t* req = c.in + used;
+                    int length = req[4] << 8 | req[5];  //Unit + PDU
+                    if (req[2] != 0 || req[3] != 0 || length < 2 || length > TCP_MAX_ADU_SIZE - 6)
+                    {
+                        stats.protocolErrors++;
+                        alive = false;
+                        break;
+                    }
+                    if (c.inLen - used < 6 + length) break;
+                    used += 6 + length;
+                    if (unit >= 0 && req[6] != unit) continue;  //Not ours: no answer, as on a serial line
+
+                    uint8_t rsp[TCP_MAX_ADU_SIZE];
+                    int pdu = answer(req + MBAP_HEADER_SIZE, length - 1, image, stale, rsp + MBAP_HEADER_SIZE);
+                    std::memcpy(rsp, req, 4);           //Transaction and protocol identifiers
+                    rsp[4] = (pdu + 1) >> 8;
+                    rsp[5] = (pdu + 1) & 0xFF;
+                    rsp[6] = req[6];
+                    c.out.insert(c.out.end(), rsp, rsp + MBAP_HEADER_SIZE + pdu);
+                    stats.requests++;
+                    if (rsp[MBAP_HEADER_SIZE] & 0x80) stats.exceptions++;
+                }
+                std::memmove(c.in, c.in + used, c.inLen - used);
+                c.inLen -= used;
+            }
+            if (alive && !c.out.empty()) alive = flush(fd, c);
+            if (!alive) drop(fd);
+        }
+    }
+
+    spu.stopPolling();
+    for (auto& c : clients) close(c.first);
+    close(server);
+    close(epfd);
+    printStats();
+    return 0;
+}
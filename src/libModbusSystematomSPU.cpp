@@ -20,15 +20,124 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <libModbusSystematomSPU.h>
 
 #include <modbus/modbus-rtu.h>
+#include <modbus/modbus-tcp.h>
 #include <modbus/modbus.h>
 
-struct libModbusSystematomSPU_private {
+#include <libModbusSystematomSPU_seqlock.h>
+#include <libModbusSystematomSPU_journal.h>
+#include <libModbusSystematomSPU_rtu.h>
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <utility>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+struct libModbusSystematomSPU_bus_private {
     std::string portname;
-    modbus_t* ctx;
+    //config and turnaround change with the line taken and configMtx held: holding either is enough to read them
+    SPU_CONFIG config;
+    std::chrono::microseconds turnaround{0}; //Measured by autoTune()
+    std::mutex configMtx;
+    modbus_t* ctx = nullptr;    //One context for the life of the bus, reconnected in place
+    int ctxBaudrate = 0;        //Baudrate ctx was created with (autoTune() may need a new one)
+    std::atomic<bool> connected{false};
+
+    //Built-in RTU engine (instead of ctx, config.nativeRtu)
+    int fd = -1;
+    bool flushInput = false; //A failed transaction may leave a late answer in the input queue
+
+    //Transactions are served in arrival order (ticket lock) so devices sharing the line interleave
+    std::mutex mtx;
+    std::condition_variable turn;
+    unsigned long nextTicket = 0;
+    unsigned long serving    = 0;
+    std::chrono::steady_clock::time_point lastFrameEnd;
+    std::chrono::microseconds t35{0}; //Minimum silent interval between frames
+
+    //Metrics (SPU_BUS_METRICS)
+    libModbusSystematomSPU_histogram transaction;
+    std::atomic<uint64_t> transactions{0}, failures{0}, timeouts{0}, crcErrors{0}, exceptions{0}, otherErrors{0}, retries{0}, reconnects{0};
+    std::atomic<uint64_t> connects{0};
+
+    //Supervisor: reopens the line off the hot path, with exponential backoff and jitter
+    std::thread supervisor;
+    std::mutex supervisorMtx;
+    std::condition_variable supervisorCv;
+    bool stopping = false;
+    bool tuned = false;
+
+    bool isTcp() { return portname.rfind("tcp://", 0) == 0; }
+    void setBaudrate(int baudrate)
+    {
+        config.baudrate = baudrate;
+        // 3.5 characters of 10 bits, fixed at 1750 µs above 19200 baud (no silent interval over TCP)
+        t35 = std::chrono::microseconds(isTcp() ? 0 : baudrate > 19200 ? 1750 : 35000000 / baudrate);
+    }
+};
+
+struct libModbusSystematomSPU_private {
+    std::shared_ptr<libModbusSystematomSPU_bus> bus;
+    std::string portname;   //Copy of the bus one, so error paths need no allocation
+    int slave = 0x01;
     SPU_DATA spuData;
-    bool flagNotConnected;//Devido a um erro na biblioteca ModBus na função modbus_free() que causa falha
-    //de segmentação, fez-se necessário criar essa flag para as funções da categoria get_data...() consigam
-    //saber que o dispositivo não existe para emitir STATE 2 (desconectado)
+    SPU_READ_COST cost;
+    uint16_t regs[SPU_REGISTER_IMAGE_SIZE] = {}; //Imagem dos registradores, indexada pelo endereço MODBUS
+
+    //Plans of the last field sets read and the request frame of each block (with CRC), reused while they
+    //repeat. A few of them, since the polling scheduler cycles through several combinations of groups.
+    struct PLAN { SPU_READ_PLAN plan; bool valid = false; uint8_t frames[SPU_FIELD_COUNT][SPU_RTU_REQUEST_SIZE]; };
+    PLAN plans[4];
+    int nextPlan = 0;
+    unsigned long long seq = 0;
+
+    //Single flight: one caller at a time reads the bus (the leader) for the fields in inFlight; callers
+    //asking for a subset wait for it and take its result. spuData, fieldTime and the members above
+    //(regs, plans, seq) belong to the leader while it reads, to flightMtx otherwise.
+    std::mutex flightMtx;
+    std::condition_variable flightDone;
+    uint32_t inFlight = 0;
+    uint64_t flights  = 0;                          //Reads finished
+    SPU_DATA flightResult;
+    std::chrono::steady_clock::time_point fieldTime[SPU_FIELD_COUNT];  //Last good read of each field
+    std::chrono::microseconds maxAge{0};            //Default freshness window (SPU_CONFIG)
+
+    //Background polling
+    struct SAMPLE { SPU_DATA data; std::chrono::steady_clock::time_point acquired; };
+    libModbusSystematomSPU_seqlock<SAMPLE> latest;
+    std::thread poller;
+    std::atomic<bool> polling{false};
+    std::vector<SPU_SCHEDULE_GROUP> schedule;
+    SPU_REALTIME realtime;
+    libModbusSystematomSPU_histogram pollLateness;
+    std::atomic<uint64_t> pollCycles{0}, deadlineMisses{0};
+
+    //Metrics (SPU_METRICS)
+    libModbusSystematomSPU_histogram paths[SPU_PATH_COUNT];
+    std::atomic<uint64_t> samples{0}, failedSamples{0};
+    std::atomic<int64_t>  rateStart{0};           //steady_clock ns where the current rate window began
+    std::atomic<uint64_t> rateSamples{0};         //samples at that moment
+    std::atomic<double>   rate{0};
+
+    //Consumers of every sample
+    std::mutex subscribersMtx;
+    std::vector<std::shared_ptr<libModbusSystematomSPU_stream>> streams;
+    //Callbacks are copied on write, so publish() can call them without holding subscribersMtx
+    typedef std::vector<std::pair<int, std::function<void(const SPU_DATA&)>>> CALLBACKS;
+    std::shared_ptr<const CALLBACKS> callbacks = std::make_shared<const CALLBACKS>();
+    int nextCallbackId = 0;
 };
 
 void libModbusSystematomSPU_license()
@@ -40,54 +149,415 @@ void libModbusSystematomSPU_license()
     std::cout << "that came together with the library." << std::endl << std::endl;
 }
 
-bool libModbusSystematomSPU::tryConnect()
+static SPU_CONFIG busConfig(int baudrate, bool nativeRtu)
 {
-    // Create a new Modbus context
-    this->_p->ctx = modbus_new_rtu(this->_p->portname.c_str(), 57600, 'N', 8, 1);
+    SPU_CONFIG config;
+    config.baudrate  = baudrate;
+    config.nativeRtu = nativeRtu;
+    return config;
+}
 
-    // Set the slave address
-    modbus_set_slave(this->_p->ctx, 0x01);
+libModbusSystematomSPU_bus::libModbusSystematomSPU_bus(std::string portname, int baudrate, bool nativeRtu)
+    : libModbusSystematomSPU_bus(portname, busConfig(baudrate, nativeRtu))
+{
+}
 
-    if (this->_p->ctx == nullptr || modbus_connect(this->_p->ctx) == -1) 
+libModbusSystematomSPU_bus::libModbusSystematomSPU_bus(std::string portname, SPU_CONFIG config)
+{
+    this->_p = new libModbusSystematomSPU_bus_private;
+    this->_p->portname = portname;
+    this->_p->config = config;
+    this->_p->config.nativeRtu = config.nativeRtu && !this->_p->isTcp();
+    this->_p->setBaudrate(config.baudrate);
+
+    // Without a background connection, open (and tune) the line before returning, as always
+    bool failed = false;
+    if (!config.backgroundConnect)
     {
-        std::cerr << stdErrorMsg("tryConnect()","Failed to connect to Modbus device:", modbus_strerror(errno));
-        modbus_close(this->_p->ctx);
-        //modbus_free(this->_p->ctx); //Bug na biblioteca causa falha de segmentação
-        this->_p->flagNotConnected=1;
-        return 1;
+        failed = tryConnect();
+        if (!failed && config.autoTune) autoTune();
+        this->_p->tuned = true;
+    }
+    if (config.backgroundConnect || config.autoReconnect)
+        this->_p->supervisor = std::thread([this, failed]{ supervise(failed); });
+}
+
+libModbusSystematomSPU_bus::~libModbusSystematomSPU_bus() {
+    {
+        std::lock_guard<std::mutex> lock(this->_p->supervisorMtx);
+        this->_p->stopping = true;
+    }
+    this->_p->supervisorCv.notify_all();
+    if (this->_p->supervisor.joinable()) this->_p->supervisor.join();
+
+    // Close the Modbus connection
+    closeLine();
+    if (this->_p->ctx) modbus_free(this->_p->ctx);
+    delete this->_p;
+}
+
+// Called with the line taken
+void libModbusSystematomSPU_bus::closeLine()
+{
+    if (this->_p->fd >= 0) close(this->_p->fd);
+    this->_p->fd = -1;
+    if (this->_p->ctx && this->_p->connected) modbus_close(this->_p->ctx);
+    this->_p->connected = false;
+}
+
+// Called with the line taken
+bool libModbusSystematomSPU_bus::openLine()
+{
+    const std::string& portname = this->_p->portname;
+    const SPU_CONFIG& config = this->_p->config;
+    closeLine();
+    if (config.nativeRtu)
+    {
+        this->_p->fd = libModbusSystematomSPU_rtu_open(portname.c_str(), config.baudrate, true);
+        if (this->_p->fd < 0)
+        {
+            libModbusSystematomSPU_report(SPU_ERROR_CONNECT, errno, "libModbusSystematomSPU_bus", "tryConnect()", portname.c_str());
+            return 1;
+        }
+        if (config.lowLatency) libModbusSystematomSPU_rtu_low_latency(this->_p->fd);
     }
     else
     {
-        std::cout << "Connection successful to: " << get_portname() << std::endl;
-        this->_p->flagNotConnected=0;
+        // The context is kept across failures and reconnections; only a new baudrate needs a new one
+        if (this->_p->ctx && this->_p->ctxBaudrate != config.baudrate)
+        {
+            modbus_free(this->_p->ctx);
+            this->_p->ctx = nullptr;
+        }
+        if (this->_p->ctx == nullptr)
+        {
+            if (this->_p->isTcp())
+            {
+                size_t colon = portname.rfind(':');
+                std::string host = portname.substr(6, colon > 5 ? colon - 6 : std::string::npos);
+                int port = colon > 5 ? std::atoi(portname.c_str() + colon + 1) : 502;
+                this->_p->ctx = modbus_new_tcp(host.c_str(), port);
+            }
+            else
+                this->_p->ctx = modbus_new_rtu(portname.c_str(), config.baudrate, 'N', 8, 1);
+            this->_p->ctxBaudrate = config.baudrate;
+        }
+        if (this->_p->ctx == nullptr || modbus_connect(this->_p->ctx) == -1)
+        {
+            libModbusSystematomSPU_report(SPU_ERROR_CONNECT, errno, "libModbusSystematomSPU_bus", "tryConnect()", portname.c_str());
+            return 1;
+        }
+        modbus_set_byte_timeout(this->_p->ctx, config.byteTimeout.count() / 1000000, config.byteTimeout.count() % 1000000);
+        if (config.lowLatency && !this->_p->isTcp()) libModbusSystematomSPU_rtu_low_latency(modbus_get_socket(this->_p->ctx));
+    }
+    this->_p->flushInput = false;
+    this->_p->connected = true;
+    return 0;
+}
+
+// Wait for the line like a transaction, and give it back
+void libModbusSystematomSPU_bus::takeLine()
+{
+    std::unique_lock<std::mutex> lock(this->_p->mtx);
+    unsigned long ticket = this->_p->nextTicket++;
+    this->_p->turn.wait(lock, [&]{ return this->_p->serving == ticket; });
+}
+
+void libModbusSystematomSPU_bus::releaseLine()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->_p->mtx);
+        this->_p->serving++;
+    }
+    this->_p->turn.notify_all();
+}
+
+void libModbusSystematomSPU_bus::setConfig(const SPU_CONFIG& config, std::chrono::microseconds turnaround)
+{
+    takeLine();
+    {
+        std::lock_guard<std::mutex> lock(this->_p->configMtx);
+        this->_p->config = config;
+        this->_p->setBaudrate(config.baudrate);
+        this->_p->turnaround = turnaround;
+    }
+    if (!config.nativeRtu && this->_p->ctx)
+        modbus_set_byte_timeout(this->_p->ctx, config.byteTimeout.count() / 1000000, config.byteTimeout.count() % 1000000);
+    releaseLine();
+}
+
+bool libModbusSystematomSPU_bus::tryConnect()
+{
+    if (this->_p->connects++ > 0) this->_p->reconnects++;
+
+    takeLine();
+    bool failed = openLine();
+    releaseLine();
+
+    if (failed) return 1;
+    libModbusSystematomSPU_report(SPU_INFO_CONNECTED, 0, "libModbusSystematomSPU_bus", "tryConnect()", this->_p->portname.c_str());
+    { std::lock_guard<std::mutex> supervisorLock(this->_p->supervisorMtx); }
+    this->_p->supervisorCv.notify_all();
+    return 0;
+}
+
+void libModbusSystematomSPU_bus::supervise(bool failed)
+{
+    std::minstd_rand rng(std::random_device{}());
+    const SPU_CONFIG config = get_config();
+    auto backoff = config.reconnectMin;
+    std::unique_lock<std::mutex> lock(this->_p->supervisorMtx);
+    for (;;)
+    {
+        this->_p->supervisorCv.wait(lock, [&]{ return this->_p->stopping || !this->_p->connected; });
+        if (this->_p->stopping) return;
+
+        // After a failed attempt wait between half and all of the backoff, so many lines do not retry in step
+        if (failed)
+        {
+            auto half = backoff / 2;
+            auto wait = half + std::chrono::milliseconds(std::uniform_int_distribution<long>(0, half.count())(rng));
+            if (this->_p->supervisorCv.wait_for(lock, wait, [&]{ return this->_p->stopping; })) return;
+            backoff = std::min(backoff * 2, config.reconnectMax);
+        }
+
+        lock.unlock();
+        failed = tryConnect();
+        if (!failed && !this->_p->tuned)
+        {
+            if (config.autoTune) autoTune();
+            this->_p->tuned = true;
+        }
+        lock.lock();
+        if (!failed) backoff = config.reconnectMin;
+        if (!config.autoReconnect && this->_p->tuned && !failed) break;
+    }
+}
+
+bool libModbusSystematomSPU_bus::waitConnected(std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(this->_p->supervisorMtx);
+    return !this->_p->supervisorCv.wait_for(lock, timeout, [&]{ return this->_p->connected.load(); });
+}
+
+std::string libModbusSystematomSPU_bus::get_portname() { return this->_p->portname; }
+int         libModbusSystematomSPU_bus::get_baudrate() { return get_config().baudrate; }
+bool        libModbusSystematomSPU_bus::isConnected()  { return this->_p->connected.load(std::memory_order_relaxed); }
+bool        libModbusSystematomSPU_bus::isNativeRtu()  { return get_config().nativeRtu; }
+
+SPU_CONFIG libModbusSystematomSPU_bus::get_config()
+{
+    std::lock_guard<std::mutex> lock(this->_p->configMtx);
+    return this->_p->config;
+}
+
+std::chrono::microseconds libModbusSystematomSPU_bus::get_turnaround()
+{
+    std::lock_guard<std::mutex> lock(this->_p->configMtx);
+    return this->_p->turnaround;
+}
+
+SPU_BUS_METRICS libModbusSystematomSPU_bus::get_metrics()
+{
+    SPU_BUS_METRICS m;
+    m.transaction  = this->_p->transaction.snapshot();
+    m.transactions = this->_p->transactions.load(std::memory_order_relaxed);
+    m.failures     = this->_p->failures.load(std::memory_order_relaxed);
+    m.timeouts     = this->_p->timeouts.load(std::memory_order_relaxed);
+    m.crcErrors    = this->_p->crcErrors.load(std::memory_order_relaxed);
+    m.exceptions   = this->_p->exceptions.load(std::memory_order_relaxed);
+    m.otherErrors  = this->_p->otherErrors.load(std::memory_order_relaxed);
+    m.retries      = this->_p->retries.load(std::memory_order_relaxed);
+    m.reconnects   = this->_p->reconnects.load(std::memory_order_relaxed);
+    return m;
+}
+
+bool libModbusSystematomSPU_bus::autoTune(int slave, std::vector<int> baudrates, int probes)
+{
+    const SPU_CONFIG original = get_config();
+    const auto originalTurnaround = get_turnaround();
+    uint64_t reconnects = this->_p->reconnects; // Probing is not a reconnection
+    std::vector<long> samples;
+    samples.reserve(probes);
+
+    // Probes are single transactions with the configured timeout: no retries, no hedge
+    SPU_CONFIG probe = original;
+    probe.retries = 0;
+    probe.hedgeTimeout = std::chrono::microseconds(0);
+    for (int baudrate : baudrates)
+    {
+        probe.baudrate = baudrate;
+        setConfig(probe, originalTurnaround);
+        if (tryConnect()) continue;
+
+        // Turnaround = transaction time minus the time the 8 + 9 characters take on the wire
+        long wire = 17 * 10000000L / baudrate;
+        samples.clear();
+        uint16_t regs[2];
+        // A wrong baudrate answers nothing or garbage: tolerate the odd lost frame, not more
+        int failures = 0;
+        for (int i = 0; i < probes && failures <= probes / 8; i++)
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            if (read_registers(slave, 0x0001, 2, regs) == -1) { failures++; continue; }
+            auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+            samples.push_back(std::max(us - wire, 0L));
+        }
+        if (failures > probes / 8 || samples.empty()) continue;
+
+        std::sort(samples.begin(), samples.end());
+        auto turnaround = std::chrono::microseconds(samples[(samples.size() * 99 + 99) / 100 - 1]);
+
+        // A quarter of margin over the p99, plus the request still being sent when the timer starts.
+        // Between bytes only a truncated frame waits: stay above the 16 ms latency timer of USB adapters.
+        long charTime = 10000000L / baudrate;
+        SPU_CONFIG config = original;
+        config.baudrate        = baudrate;
+        config.responseTimeout = std::chrono::microseconds(turnaround.count() * 5 / 4 + 8 * charTime + 1000);
+        config.byteTimeout     = std::chrono::microseconds(std::max(32 * charTime, 20000L));
+        if (config.hedgeTimeout >= config.responseTimeout) config.hedgeTimeout = std::chrono::microseconds(0);
+        setConfig(config, turnaround);
+        // get_baudrate() and get_turnaround() tell the result
+        libModbusSystematomSPU_report(SPU_INFO_AUTOTUNED, 0, "libModbusSystematomSPU_bus", "autoTune()", this->_p->portname.c_str());
+        this->_p->reconnects = reconnects;
         return 0;
-    } 
+    }
+
+    libModbusSystematomSPU_report(SPU_ERROR_AUTOTUNE, 0, "libModbusSystematomSPU_bus", "autoTune()", this->_p->portname.c_str());
+    setConfig(original, originalTurnaround);
+    tryConnect();
+    this->_p->reconnects = reconnects;
+    return 1;
+}
+
+// Exception answers are final; anything else may be a lost or damaged frame
+static bool retryable(int error)
+{
+    return !(error > MODBUS_ENOBASE && error <= EMBXGTAR) && error != ENOTCONN;
+}
+
+// The adapter or the connection is gone: no use trying again until the line is reopened
+static bool lineLost(int error)
+{
+    return error == EIO || error == ENXIO || error == ENODEV || error == EBADF ||
+           error == EPIPE || error == ECONNRESET || error == ENOTCONN;
+}
+
+int libModbusSystematomSPU_bus::read_registers(int slave, int start_address, int num_registers, uint16_t* dest, const uint8_t* request)
+{
+    // Wait for our turn on the line
+    std::unique_lock<std::mutex> lock(this->_p->mtx);
+    unsigned long ticket = this->_p->nextTicket++;
+    this->_p->turn.wait(lock, [&]{ return this->_p->serving == ticket; });
+
+    // Keep the silent interval after the previous response, then start our frame right away.
+    // Retries keep the line: the first attempt may use the shorter hedge timeout.
+    const SPU_CONFIG& config = this->_p->config;
+    int result = -1;
+    int error  = ENOTCONN;
+    bool lineDown = false;
+    std::chrono::steady_clock::time_point start;
+    for (int attempt = 0; attempt <= config.retries && isConnected(); attempt++)
+    {
+        std::chrono::microseconds timeout = attempt == 0 && config.hedgeTimeout.count() > 0 ? config.hedgeTimeout : config.responseTimeout;
+        std::this_thread::sleep_until(this->_p->lastFrameEnd + this->_p->t35);
+        if (attempt == 0) start = std::chrono::steady_clock::now();
+        else              this->_p->retries.fetch_add(1, std::memory_order_relaxed);
+        if (config.nativeRtu)
+        {
+            uint8_t frame[SPU_RTU_REQUEST_SIZE];
+            if (request == nullptr)
+            {
+                libModbusSystematomSPU_rtu_request(frame, slave, start_address, num_registers);
+                request = frame;
+            }
+            if (this->_p->flushInput) tcflush(this->_p->fd, TCIFLUSH);
+            result = libModbusSystematomSPU_rtu_transact(this->_p->fd, request, num_registers, dest, timeout, config.byteTimeout);
+            this->_p->flushInput = result < 0;
+        }
+        else
+        {
+            if (this->_p->flushInput) modbus_flush(this->_p->ctx);
+            modbus_set_slave(this->_p->ctx, slave);
+            modbus_set_response_timeout(this->_p->ctx, timeout.count() / 1000000, timeout.count() % 1000000);
+            result = modbus_read_registers(this->_p->ctx, start_address, num_registers, dest);
+            this->_p->flushInput = result < 0;
+        }
+        error  = errno;
+        this->_p->lastFrameEnd = std::chrono::steady_clock::now();
+        if (result >= 0) break;
+        if      (error == ETIMEDOUT)                              this->_p->timeouts.fetch_add(1, std::memory_order_relaxed);
+        else if (error == EMBBADCRC)                              this->_p->crcErrors.fetch_add(1, std::memory_order_relaxed);
+        else if (error > MODBUS_ENOBASE && error <= EMBXGTAR)     this->_p->exceptions.fetch_add(1, std::memory_order_relaxed);
+        else                                                      this->_p->otherErrors.fetch_add(1, std::memory_order_relaxed);
+        if (lineLost(error))
+        {
+            closeLine();
+            lineDown = true;
+            break;
+        }
+        if (!retryable(error)) break;
+    }
+    if (start != std::chrono::steady_clock::time_point())
+    {
+        this->_p->transaction.record(this->_p->lastFrameEnd - start);
+        this->_p->transactions.fetch_add(1, std::memory_order_relaxed);
+        if (result < 0) this->_p->failures.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    this->_p->serving++;
+    lock.unlock();
+    this->_p->turn.notify_all();
+    if (lineDown)
+    {
+        { std::lock_guard<std::mutex> supervisorLock(this->_p->supervisorMtx); }
+        this->_p->supervisorCv.notify_all();
+    }
+    errno = error;
+    return result;
 }
 
 libModbusSystematomSPU::libModbusSystematomSPU(std::string portname)
+    : libModbusSystematomSPU(std::make_shared<libModbusSystematomSPU_bus>(portname), 0x01)
+{
+}
+
+libModbusSystematomSPU::libModbusSystematomSPU(std::string portname, SPU_CONFIG config)
+    : libModbusSystematomSPU(std::make_shared<libModbusSystematomSPU_bus>(portname, config), 0x01)
+{
+}
+
+libModbusSystematomSPU::libModbusSystematomSPU(std::shared_ptr<libModbusSystematomSPU_bus> bus, int slave)
 {
     this->_p = new libModbusSystematomSPU_private;
-    this->_p->portname = portname;
-    tryConnect();
+    this->_p->bus = bus;
+    this->_p->portname = bus->get_portname();
+    this->_p->slave = slave;
+    // Until a turnaround is measured, assume 10 ms
+    auto turnaround = bus->get_turnaround();
+    this->_p->cost = libModbusSystematomSPU_cost(bus->get_baudrate(), turnaround.count() > 0 ? turnaround.count() : 10000);
+    this->_p->maxAge = bus->get_config().maxAge;
 }
 
 libModbusSystematomSPU::~libModbusSystematomSPU() {
-    // Close the Modbus connection
-    if (this->_p->ctx) {
-        modbus_close(this->_p->ctx);
-        //modbus_free(this->_p->ctx); //Bug na biblioteca causa falha de segmentação
-    }
+    stopPolling();
+    // The line closes (and its supervisor stops) with the last device that shares the bus
+    delete this->_p;
 }
 
-std::string  libModbusSystematomSPU::get_portname()    { return this->_p->portname; }
+bool libModbusSystematomSPU::tryConnect() { return this->_p->bus->tryConnect(); }
 
-float libModbusSystematomSPU::conv2RegsToFloat(uint16_t data1, uint16_t data2)
+bool libModbusSystematomSPU::autoTune()
 {
-    uint16_t data[2] = {data2, data1};
-    float* floatValue = reinterpret_cast<float*>(data);
-    return *floatValue;
+    if (this->_p->bus->autoTune(this->_p->slave)) return 1;
+    set_read_cost(libModbusSystematomSPU_cost(this->_p->bus->get_baudrate(), this->_p->bus->get_turnaround().count()));
+    return 0;
 }
 
+std::string  libModbusSystematomSPU::get_portname()    { return this->_p->bus->get_portname(); }
+int          libModbusSystematomSPU::get_slave()       { return this->_p->slave; }
+std::shared_ptr<libModbusSystematomSPU_bus> libModbusSystematomSPU::get_bus() { return this->_p->bus; }
+
 /*
 ////// FLOAT32 ////////////////
 
@@ -132,282 +602,799 @@ float libModbusSystematomSPU::conv2RegsToFloat(uint16_t data1, uint16_t data2)
 0x006D  ?
 */
 
-std::string libModbusSystematomSPU::stdErrorMsg(std::string functionName, std::string errorMsg, std::string exptionMsg)
+// Where each field of SPU_DATA lives in the register map above (sorted by address)
+struct SPU_FIELD_MAP
 {
-    std::string msg =   "ERROR in libModbusSystematomSPU::" + 
-                        functionName +
-                        " at " + 
-                        get_portname() + 
-                        "\n\tError type: " + 
-                        errorMsg;
-    if (exptionMsg!="") 
+    SPU_FIELD         field;
+    int               address;
+    int               size;     // Number of registers (2 = FLOAT32, 1 = INT16)
+    float SPU_DATA::* fp;
+    int   SPU_DATA::* i16;
+};
+
+static constexpr SPU_FIELD_MAP SPU_FIELD_TABLE[SPU_FIELD_COUNT] = {
+    {SPU_FIELD_N_DATA_FP,       0x0001, 2, &SPU_DATA::N_DATA_FP,       nullptr},
+    {SPU_FIELD_T_DATA_FP,       0x0003, 2, &SPU_DATA::T_DATA_FP,       nullptr},
+    {SPU_FIELD_F1_DATA_FP,      0x0005, 2, &SPU_DATA::F1_DATA_FP,      nullptr},
+    {SPU_FIELD_F2_DATA_FP,      0x0007, 2, &SPU_DATA::F2_DATA_FP,      nullptr},
+    {SPU_FIELD_F3_DATA_FP,      0x0009, 2, &SPU_DATA::F3_DATA_FP,      nullptr},
+    {SPU_FIELD_EMR_N_THRESHOLD, 0x000B, 2, &SPU_DATA::EMR_N_THRESHOLD, nullptr},
+    {SPU_FIELD_WRN_N_THRESHOLD, 0x000D, 2, &SPU_DATA::WRN_N_THRESHOLD, nullptr},
+    {SPU_FIELD_EMR_T_THRESHOLD, 0x000F, 2, &SPU_DATA::EMR_T_THRESHOLD, nullptr},
+    {SPU_FIELD_WRN_T_THRESHOLD, 0x0011, 2, &SPU_DATA::WRN_T_THRESHOLD, nullptr},
+    {SPU_FIELD_EMR_N,           0x0064, 1, nullptr, &SPU_DATA::EMR_N},
+    {SPU_FIELD_WRN_N,           0x0065, 1, nullptr, &SPU_DATA::WRN_N},
+    {SPU_FIELD_EMR_T,           0x0066, 1, nullptr, &SPU_DATA::EMR_T},
+    {SPU_FIELD_WRN_T,           0x0067, 1, nullptr, &SPU_DATA::WRN_T},
+    {SPU_FIELD_R1,              0x0068, 1, nullptr, &SPU_DATA::R1},
+    {SPU_FIELD_R2,              0x0069, 1, nullptr, &SPU_DATA::R2},
+    {SPU_FIELD_R3,              0x006A, 1, nullptr, &SPU_DATA::R3},
+    {SPU_FIELD_RDY,             0x006B, 1, nullptr, &SPU_DATA::RDY},
+    {SPU_FIELD_TEST,            0x006C, 1, nullptr, &SPU_DATA::TEST},
+    {SPU_FIELD_XXXX,            0x006D, 1, nullptr, &SPU_DATA::XXXX},
+};
+
+// Row k describes SPU_FIELD bit k; rows are sorted and disjoint; FLOAT32 rows first (SPU_RECORD order)
+static constexpr bool fieldTableValid()
+{
+    for (int k = 0; k < SPU_FIELD_COUNT; k++)
     {
-        msg +=          "\n\tError code: " + 
-                        exptionMsg;
+        const SPU_FIELD_MAP& f = SPU_FIELD_TABLE[k];
+        if (f.field != SPU_FIELD(1u << k)) return false;
+        if ((f.fp != nullptr) == (f.i16 != nullptr) || f.size != (f.fp ? 2 : 1)) return false;
+        if (f.address < 0 || f.address + f.size > SPU_REGISTER_IMAGE_SIZE) return false;
+        if (k > 0 && SPU_FIELD_TABLE[k-1].address + SPU_FIELD_TABLE[k-1].size > f.address) return false;
+        if (k > 0 && f.fp && !SPU_FIELD_TABLE[k-1].fp) return false;
     }
-    msg += "\n";
-    return msg;
+    return true;
 }
+static_assert(fieldTableValid(), "SPU_FIELD_TABLE does not match SPU_FIELD");
+static_assert(SPU_FIELD_TABLE[SPU_FIELD_COUNT-1].address + 1 == SPU_REGISTER_IMAGE_SIZE, "SPU_REGISTER_IMAGE_SIZE ends at the last field");
+static_assert(SPU_FIELD_TABLE[SPU_FIELD_COUNT-1].address + 1 - SPU_FIELD_TABLE[0].address <= SPU_MAX_READ_REGISTERS,
+              "get_all() fits in one transaction");
+static_assert(SPU_FIELD_ALL == (1u << SPU_FIELD_COUNT) - 1);
 
-SPU_DATA libModbusSystematomSPU::get_all()
+template <SPU_FIELD F>
+static constexpr const SPU_FIELD_MAP& fieldMap() { return SPU_FIELD_TABLE[std::countr_zero(uint32_t(F))]; }
+
+// FLOAT32: high word first
+static inline float regsToFloat(const uint16_t* regs) { return std::bit_cast<float>(uint32_t(regs[0]) << 16 | regs[1]); }
+
+template <size_t K>
+static inline void decodeField(const uint16_t* regs, SPU_DATA& data)
 {
-    // Check if the Modbus context exists
-    if (!this->_p->ctx || this->_p->flagNotConnected) {
-        std::cerr << stdErrorMsg("get_all()","Modbus context does not exist","");
-        this->_p->spuData.STATE = 2;
-        this->_p->spuData.TIME = std::chrono::system_clock::now();
-        return this->_p->spuData;
+    constexpr const SPU_FIELD_MAP& f = SPU_FIELD_TABLE[K];
+    if constexpr (f.fp != nullptr) data.*f.fp  = regsToFloat(regs + f.address);
+    else                           data.*f.i16 = regs[f.address];
+}
+
+template <size_t K>
+static inline void encodeField(const SPU_DATA& data, uint16_t* regs)
+{
+    constexpr const SPU_FIELD_MAP& f = SPU_FIELD_TABLE[K];
+    if constexpr (f.fp != nullptr)
+    {
+        uint32_t u = std::bit_cast<uint32_t>(data.*f.fp);
+        regs[f.address]     = u >> 16;
+        regs[f.address + 1] = u & 0xFFFF;
     }
+    else regs[f.address] = static_cast<uint16_t>(data.*f.i16);
+}
+
+// The table unrolled at compile time: one straight pass, member pointers and addresses as constants
+template <size_t... K>
+static inline void decodeFields(const uint16_t* regs, SPU_DATA& data, uint32_t fields, std::index_sequence<K...>)
+{
+    if (fields == SPU_FIELD_ALL) (decodeField<K>(regs, data), ...);
+    else ((fields & (1u << K) ? decodeField<K>(regs, data) : void()), ...);
+}
+
+template <size_t... K>
+static inline void encodeFields(const SPU_DATA& data, uint16_t* regs, uint32_t fields, std::index_sequence<K...>)
+{
+    if (fields == SPU_FIELD_ALL) (encodeField<K>(data, regs), ...);
+    else ((fields & (1u << K) ? encodeField<K>(data, regs) : void()), ...);
+}
+
+void libModbusSystematomSPU_encode(const SPU_DATA& data, uint16_t* regs, uint32_t fields)
+{
+    encodeFields(data, regs, fields, std::make_index_sequence<SPU_FIELD_COUNT>());
+}
 
-    // Read from the register 0x0001 to 0x0012
-    int start_address =          0x0001; // Starting address
-    int   end_address =          0x0012; // Ending   address
-    int num_registers = 1 + end_address - start_address; // Number of registers to read
-    uint16_t data[num_registers];
-    int result = modbus_read_registers(this->_p->ctx, start_address, num_registers, data);
-
-    if (result == -1) {
-        std::cerr << stdErrorMsg("get_all()","Failed to read data",modbus_strerror(errno));
-        this->_p->spuData.STATE = 1;
-        this->_p->spuData.TIME = std::chrono::system_clock::now();
-        return this->_p->spuData;
+void libModbusSystematomSPU_decode(const uint16_t* regs, SPU_DATA& data, uint32_t fields)
+{
+    decodeFields(regs, data, fields, std::make_index_sequence<SPU_FIELD_COUNT>());
+}
+
+SPU_RECORD libModbusSystematomSPU_pack(const SPU_DATA& data)
+{
+    SPU_RECORD record;
+    record.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(data.TIME.time_since_epoch()).count();
+    record.seq     = data.SEQ;
+    record.state   = static_cast<int8_t>(data.STATE);
+    int fp = 0, flag = 0;
+    for (const SPU_FIELD_MAP& f : SPU_FIELD_TABLE)
+    {
+        if (f.fp) { record.fp[fp++] = data.*f.fp; continue; }
+        int v = data.*f.i16;
+        if (v >= 0) record.flagsKnown |= 1u << flag;
+        if (v >  0) record.flags      |= 1u << flag;
+        flag++;
     }
+    return record;
+}
 
-    // Convert data in floats variables
-    this->_p->spuData.N_DATA_FP       = conv2RegsToFloat(data[ 0], data[ 1]);
-    this->_p->spuData.T_DATA_FP       = conv2RegsToFloat(data[ 2], data[ 3]);
-    this->_p->spuData.F1_DATA_FP      = conv2RegsToFloat(data[ 4], data[ 5]);
-    this->_p->spuData.F2_DATA_FP      = conv2RegsToFloat(data[ 6], data[ 7]);
-    this->_p->spuData.F3_DATA_FP      = conv2RegsToFloat(data[ 8], data[ 9]);
-    this->_p->spuData.EMR_N_THRESHOLD = conv2RegsToFloat(data[10], data[11]);
-    this->_p->spuData.WRN_N_THRESHOLD = conv2RegsToFloat(data[12], data[13]);
-    this->_p->spuData.EMR_T_THRESHOLD = conv2RegsToFloat(data[14], data[15]);
-    this->_p->spuData.WRN_T_THRESHOLD = conv2RegsToFloat(data[16], data[17]);
-
-
-    // Read from the register 0x0064 to 0x006D
-    start_address =          0x0064; // Starting address
-    end_address   =          0x006D; // Ending   address
-    num_registers = 1 + end_address - start_address; // Number of registers to read
-    result = modbus_read_registers(this->_p->ctx, start_address, num_registers, data);
-
-    if (result == -1) {
-        std::cerr << stdErrorMsg("get_all()","Failed to read data",modbus_strerror(errno));
-        this->_p->spuData.STATE = 1;
-        this->_p->spuData.TIME = std::chrono::system_clock::now();
-        return this->_p->spuData;
+SPU_DATA libModbusSystematomSPU_unpack(const SPU_RECORD& record)
+{
+    SPU_DATA data;
+    data.TIME  = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(record.time_ns)));
+    data.SEQ   = record.seq;
+    data.STATE = record.state;
+    int fp = 0, flag = 0;
+    for (const SPU_FIELD_MAP& f : SPU_FIELD_TABLE)
+    {
+        if (f.fp) { data.*f.fp = record.fp[fp++]; continue; }
+        data.*f.i16 = (record.flagsKnown >> flag & 1) ? (record.flags >> flag & 1) : -1;
+        flag++;
     }
+    return data;
+}
 
-    // Convert data in floats variables
-    this->_p->spuData.EMR_N           = data[0];
-    this->_p->spuData.WRN_N           = data[1];
-    this->_p->spuData.EMR_T           = data[2];
-    this->_p->spuData.WRN_T           = data[3];
-    this->_p->spuData.R1              = data[4];
-    this->_p->spuData.R2              = data[5];
-    this->_p->spuData.R3              = data[6];
-    this->_p->spuData.RDY             = data[7];
-    this->_p->spuData.TEST            = data[8];
-    this->_p->spuData.XXXX            = data[9];
+SPU_READ_COST libModbusSystematomSPU_cost(int baudrate, float turnaround_us)
+{
+    // 8N1: 10 bits per character
+    float charTime = 10e6f / baudrate;
+    // Silent interval between frames: 3.5 characters, fixed at 1750 µs above 19200 baud
+    float t35 = baudrate > 19200 ? 1750.f : 3.5f * charTime;
 
-    this->_p->spuData.STATE           = 0;
-    this->_p->spuData.TIME = std::chrono::system_clock::now();
-    return this->_p->spuData;
+    SPU_READ_COST cost;
+    // Request (8 bytes) + response header and CRC (5 bytes) + two silent intervals + SPU turnaround
+    cost.transactionCost = 13 * charTime + 2 * t35 + turnaround_us;
+    cost.registerCost    = 2 * charTime;
+    return cost;
 }
 
-SPU_DATA libModbusSystematomSPU::get_all_update_NT()
+SPU_READ_PLAN libModbusSystematomSPU_plan(uint32_t fields, const SPU_READ_COST& cost)
 {
-    // Check if the Modbus context exists
-    if (!this->_p->ctx || this->_p->flagNotConnected) {
-        std::cerr << stdErrorMsg("get_all_update_NT()","Modbus context does not exist","");
-        this->_p->spuData.STATE = 2;
-        this->_p->spuData.TIME = std::chrono::system_clock::now();
-        return this->_p->spuData;
-    }
+    SPU_READ_PLAN plan;
+    plan.fields = fields & SPU_FIELD_ALL;
 
-    // Read from the register 0x0001 to 0x006D
-    int num_registers = 0x04; // Number of registers to read
-    int start_address = 0x01; // Starting address
-    const int dataSize = 1 + num_registers - start_address; // Total number of bytes to read
-    uint16_t data[dataSize];
+    // Register spans of the requested fields in address order (neighbour fields are merged for free)
+    SPU_READ_BLOCK spans[SPU_FIELD_COUNT];
+    int numSpans = 0;
+    for (const SPU_FIELD_MAP& f : SPU_FIELD_TABLE)
+    {
+        if (!(plan.fields & f.field)) continue;
+        if (numSpans > 0 && spans[numSpans-1].start_address + spans[numSpans-1].num_registers == f.address)
+            spans[numSpans-1].num_registers += f.size;
+        else
+            spans[numSpans++] = {f.address, f.size};
+    }
 
-    int result = modbus_read_registers(this->_p->ctx, start_address, num_registers, data);
+    // best[j] = cheapest way to read spans[0..j-1], from[j] = first span of the last transaction.
+    // A transaction may cover several spans (reading the gap registers between them) while it
+    // stays under SPU_MAX_READ_REGISTERS.
+    float best[SPU_FIELD_COUNT + 1];
+    int   from[SPU_FIELD_COUNT + 1];
+    best[0] = 0;
+    for (int j = 1; j <= numSpans; j++)
+    {
+        int end = spans[j-1].start_address + spans[j-1].num_registers;
+        best[j] = std::numeric_limits<float>::infinity();
+        for (int i = j; i >= 1; i--)
+        {
+            int len = end - spans[i-1].start_address;
+            if (len > SPU_MAX_READ_REGISTERS) break;
+            float c = best[i-1] + cost.transactionCost + cost.registerCost * len;
+            if (c < best[j]) { best[j] = c; from[j] = i; }
+        }
+    }
 
-    if (result == -1) {
-        std::cerr << stdErrorMsg("get_all_update_NT()","Failed to read data",modbus_strerror(errno));
-        this->_p->spuData.STATE = 1;
-        this->_p->spuData.TIME = std::chrono::system_clock::now();
-        return this->_p->spuData;
+    // Rebuild the transactions walking back from the last span
+    plan.cost = best[numSpans];
+    for (int j = numSpans; j > 0; j = from[j] - 1) plan.numBlocks++;
+    int k = plan.numBlocks;
+    for (int j = numSpans; j > 0; j = from[j] - 1)
+    {
+        int start = spans[from[j]-1].start_address;
+        plan.blocks[--k] = {start, spans[j-1].start_address + spans[j-1].num_registers - start};
     }
+    return plan;
+}
 
-    // Convert data in floats variables
-    this->_p->spuData.N_DATA_FP       = conv2RegsToFloat(data[ 0], data[ 1]);
-    this->_p->spuData.T_DATA_FP       = conv2RegsToFloat(data[ 2], data[ 3]);
-    this->_p->spuData.STATE           = 0;
-    this->_p->spuData.TIME = std::chrono::system_clock::now();
-    return this->_p->spuData;
+// Sample counters and the samples-per-second window (one second long)
+static void countSample(libModbusSystematomSPU_private* p, int state)
+{
+    if (state != 0) { p->failedSamples.fetch_add(1, std::memory_order_relaxed); return; }
+    uint64_t samples = p->samples.fetch_add(1, std::memory_order_relaxed) + 1;
+    int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t start = p->rateStart.load(std::memory_order_relaxed);
+    if (now - start < 1000000000) return;
+    if (start != 0) p->rate.store((samples - p->rateSamples.load(std::memory_order_relaxed)) * 1e9 / (now - start), std::memory_order_relaxed);
+    p->rateSamples.store(samples, std::memory_order_relaxed);
+    p->rateStart.store(now, std::memory_order_relaxed);
 }
 
-SPU_DATA libModbusSystematomSPU::get_all_update_NTF()
+int libModbusSystematomSPU::acquire(uint32_t fields, SPU_DATA& data, const char* functionName)
 {
+    data.AGE = std::chrono::nanoseconds(0);
+
     // Check if the Modbus context exists
-    if (!this->_p->ctx || this->_p->flagNotConnected) {
-        std::cerr << stdErrorMsg("get_all_update_NTF()","Modbus context does not exist","");
-        this->_p->spuData.STATE = 2;
-        this->_p->spuData.TIME = std::chrono::system_clock::now();
-        return this->_p->spuData;
+    if (!this->_p->bus->isConnected()) {
+        libModbusSystematomSPU_report(SPU_ERROR_NO_CONTEXT, 0, "libModbusSystematomSPU", functionName, this->_p->portname.c_str(), this->_p->slave);
+        data.STATE = 2;
+        data.TIME = std::chrono::system_clock::now();
+        countSample(this->_p, 2);
+        publish(data);
+        return 2;
     }
 
-    // Read from the register 0x0001 to 0x006D
-    int num_registers = 0x0A; // Number of registers to read
-    int start_address = 0x01; // Starting address
-    const int dataSize = 1 + num_registers - start_address; // Total number of bytes to read
-    uint16_t data[dataSize];
-
-    int result = modbus_read_registers(this->_p->ctx, start_address, num_registers, data);
+    // Polling reads the same fields over and over: plan them and build their requests only once
+    libModbusSystematomSPU_private::PLAN* cached = nullptr;
+    for (auto& p : this->_p->plans)
+        if (p.valid && p.plan.fields == (fields & SPU_FIELD_ALL)) cached = &p;
+    if (cached == nullptr)
+    {
+        cached = &this->_p->plans[this->_p->nextPlan++ % 4];
+        cached->plan = libModbusSystematomSPU_plan(fields, this->_p->cost);
+        for (int i = 0; i < cached->plan.numBlocks; i++)
+            libModbusSystematomSPU_rtu_request(cached->frames[i], this->_p->slave, cached->plan.blocks[i].start_address, cached->plan.blocks[i].num_registers);
+        cached->valid = true;
+    }
+    const SPU_READ_PLAN& plan = cached->plan;
 
-    if (result == -1) {
-        std::cerr << stdErrorMsg("get_all_update_NTF()","Failed to read data",modbus_strerror(errno));
-        this->_p->spuData.STATE = 1;
-        this->_p->spuData.TIME = std::chrono::system_clock::now();
-        return this->_p->spuData;
+    // Read every block of the plan straight to its address in the register image
+    uint16_t* regs = this->_p->regs;
+    for (int i = 0; i < plan.numBlocks; i++)
+    {
+        const SPU_READ_BLOCK& block = plan.blocks[i];
+        int result = this->_p->bus->read_registers(this->_p->slave, block.start_address, block.num_registers, regs + block.start_address, cached->frames[i]);
+        if (result == -1) {
+            libModbusSystematomSPU_report(SPU_ERROR_READ, errno, "libModbusSystematomSPU", functionName, this->_p->portname.c_str(), this->_p->slave);
+            data.STATE = 1;
+            data.TIME = std::chrono::system_clock::now();
+            countSample(this->_p, 1);
+            publish(data);
+            return 1;
+        }
     }
 
-    // Convert data in floats variables
-    this->_p->spuData.N_DATA_FP       = conv2RegsToFloat(data[ 0], data[ 1]);
-    this->_p->spuData.T_DATA_FP       = conv2RegsToFloat(data[ 2], data[ 3]);
-    this->_p->spuData.F1_DATA_FP      = conv2RegsToFloat(data[ 4], data[ 5]);
-    this->_p->spuData.F2_DATA_FP      = conv2RegsToFloat(data[ 6], data[ 7]);
-    this->_p->spuData.F3_DATA_FP      = conv2RegsToFloat(data[ 8], data[ 9]);
-    this->_p->spuData.STATE           = 0;
-    this->_p->spuData.TIME = std::chrono::system_clock::now();
-    return this->_p->spuData;
+    // Convert data in the variables of the struct
+    libModbusSystematomSPU_decode(regs, data, plan.fields);
+
+    data.STATE           = 0;
+    data.TIME = std::chrono::system_clock::now();
+    data.SEQ             = ++this->_p->seq;
+    countSample(this->_p, 0);
+    publish(data);
+    return 0;
 }
 
-SPU_DATA libModbusSystematomSPU::get_all_update_F()
+int libModbusSystematomSPU::readFields(uint32_t fields, SPU_PATH path, const char* functionName, SPU_DATA& out)
 {
-    // Check if the Modbus context exists
-    if (!this->_p->ctx || this->_p->flagNotConnected) {
-        std::cerr << stdErrorMsg("get_all_update_F()","Modbus context does not exist","");
-        this->_p->spuData.STATE = 2;
-        this->_p->spuData.TIME = std::chrono::system_clock::now();
-        return this->_p->spuData;
-    }
+    return readFields(fields, path, functionName, out, this->_p->maxAge);
+}
+
+int libModbusSystematomSPU::readFields(uint32_t fields, SPU_PATH path, const char* functionName, SPU_DATA& out,
+                                       std::chrono::microseconds maxAge)
+{
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    libModbusSystematomSPU_private* p = this->_p;
+    fields &= SPU_FIELD_ALL;
+    int state;
 
-    // Read from the register 0x0001 to 0x006D
-    int num_registers = 0x0A-0x04; // Number of registers to read
-    int start_address = 0x05; // Starting address
-    const int dataSize = 1 + num_registers - start_address; // Total number of bytes to read
-    uint16_t data[dataSize];
+    // While polling only the acquisition thread touches the bus: hand out the newest sample
+    if (p->polling.load(std::memory_order_acquire))
+    {
+        libModbusSystematomSPU_private::SAMPLE sample;
+        if (p->latest.load(sample) != 0)
+        {
+            sample.data.AGE = clock::now() - sample.acquired;
+            out = sample.data;
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(p->flightMtx);
+            out = p->spuData;
+        }
+        state = out.STATE;
+        p->paths[path].record(clock::now() - start);
+        return state;
+    }
 
-    int result = modbus_read_registers(this->_p->ctx, start_address, num_registers, data);
+    std::unique_lock<std::mutex> lock(p->flightMtx);
+    for (;;)
+    {
+        // Fresh enough: no read at all
+        if (maxAge.count() > 0)
+        {
+            auto oldest = clock::time_point::max();
+            for (uint32_t bits = fields; bits; bits &= bits - 1) oldest = std::min(oldest, p->fieldTime[std::countr_zero(bits)]);
+            if (fields != 0 && oldest != clock::time_point() && start - oldest <= maxAge)
+            {
+                out = p->spuData;
+                out.STATE = 0;
+                out.AGE = start - oldest;
+                state = 0;
+                break;
+            }
+        }
+        // Someone is reading all we need: share its result
+        if (p->inFlight != 0 && (p->inFlight & fields) == fields)
+        {
+            uint64_t flight = p->flights;
+            p->flightDone.wait(lock, [&]{ return p->flights != flight; });
+            out = p->flightResult;
+            state = out.STATE;
+            break;
+        }
+        // A read of other fields is going on: wait for the line, then look again
+        if (p->inFlight != 0)
+        {
+            uint64_t flight = p->flights;
+            p->flightDone.wait(lock, [&]{ return p->flights != flight; });
+            continue;
+        }
 
-    if (result == -1) {
-        std::cerr << stdErrorMsg("get_all_update_F()","Failed to read data",modbus_strerror(errno));
-        this->_p->spuData.STATE = 1;
-        this->_p->spuData.TIME = std::chrono::system_clock::now();
-        return this->_p->spuData;
+        state = leadRead(fields, out, functionName, lock);
+        break;
     }
+    lock.unlock();
+    p->paths[path].record(clock::now() - start);
+    return state;
+}
 
-    // Convert data in floats variables
-    this->_p->spuData.F1_DATA_FP      = conv2RegsToFloat(data[ 4], data[ 5]);
-    this->_p->spuData.F2_DATA_FP      = conv2RegsToFloat(data[ 6], data[ 7]);
-    this->_p->spuData.F3_DATA_FP      = conv2RegsToFloat(data[ 8], data[ 9]);
-    this->_p->spuData.STATE           = 0;
-    this->_p->spuData.TIME = std::chrono::system_clock::now();
-    return this->_p->spuData;
+// Read fields as the leader of a flight. Called with flightMtx held (lock) and nothing in flight.
+int libModbusSystematomSPU::leadRead(uint32_t fields, SPU_DATA& out, const char* functionName, std::unique_lock<std::mutex>& lock)
+{
+    libModbusSystematomSPU_private* p = this->_p;
+
+    // On a copy, so readers of the cache never see it half decoded
+    p->inFlight = fields ? fields : SPU_FIELD_ALL;
+    SPU_DATA data = p->spuData;
+    lock.unlock();
+    int state = acquire(fields, data, functionName);
+    auto done = std::chrono::steady_clock::now();
+    lock.lock();
+    if (state == 0)
+        for (uint32_t bits = fields; bits; bits &= bits - 1) p->fieldTime[std::countr_zero(bits)] = done;
+    p->spuData = data;
+    p->flightResult = data;
+    p->inFlight = 0;
+    p->flights++;
+    p->flightDone.notify_all();
+    out = data;
+    return state;
 }
 
- SPU_DATA libModbusSystematomSPU::get_all_update_bool ()
- {
-    // Check if the Modbus context exists
-    if (!this->_p->ctx || this->_p->flagNotConnected) {
-        std::cerr << stdErrorMsg("get_all_update_bool()","Modbus context does not exist","");
-        this->_p->spuData.STATE = 2;
-        this->_p->spuData.TIME = std::chrono::system_clock::now();
-        return this->_p->spuData;
+// Read fields once the line is free, without sharing a flight (polling: a reader that started before
+// polling may still be leading one)
+int libModbusSystematomSPU::exclusiveRead(uint32_t fields, SPU_DATA& out, const char* functionName)
+{
+    std::unique_lock<std::mutex> lock(this->_p->flightMtx);
+    this->_p->flightDone.wait(lock, [&]{ return this->_p->inFlight == 0; });
+    return leadRead(fields, out, functionName, lock);
+}
+
+std::vector<SPU_SCHEDULE_GROUP> libModbusSystematomSPU_default_schedule(const SPU_READ_COST& cost)
+{
+    std::vector<SPU_SCHEDULE_GROUP> schedule = {
+        {SPU_FIELD_BOOL,       std::chrono::microseconds(5000),     3},
+        {SPU_FIELD_NT,         std::chrono::microseconds(10000),    2},
+        {SPU_FIELD_F,          std::chrono::microseconds(100000),   1},
+        {SPU_FIELD_THRESHOLDS, std::chrono::microseconds(10000000), 0},
+    };
+    // A group is never due faster than one read of it and of the groups faster than it takes on this line
+    uint32_t fields = 0;
+    for (SPU_SCHEDULE_GROUP& group : schedule)
+    {
+        fields |= group.fields;
+        auto read = std::chrono::microseconds(static_cast<long>(std::ceil(libModbusSystematomSPU_plan(fields, cost).cost)));
+        group.period = std::max(group.period, read);
+    }
+    return schedule;
+}
+
+// SCHED_FIFO, CPU affinity and locked memory for the calling thread; what fails is reported and skipped
+static void applyRealtime(const SPU_REALTIME& rt, const char* port, int slave)
+{
+    if (rt.lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+        libModbusSystematomSPU_report(SPU_ERROR_REALTIME, errno, "libModbusSystematomSPU", "mlockall()", port, slave);
+    if (rt.cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(rt.cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err) libModbusSystematomSPU_report(SPU_ERROR_REALTIME, err, "libModbusSystematomSPU", "pthread_setaffinity_np()", port, slave);
     }
+    sched_param param = {};
+    param.sched_priority = rt.priority;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err) libModbusSystematomSPU_report(SPU_ERROR_REALTIME, err, "libModbusSystematomSPU", "pthread_setschedparam()", port, slave);
 
-    // Read from the register 0x0001 to 0x006D
-    int num_registers = 0x0A; // Number of registers to read
-    int start_address = 0x64; // Starting address
-    const int dataSize = 1 + num_registers - start_address; // Total number of bytes to read
-    uint16_t data[dataSize];
+    // Fault the stack in now, so the loop never takes a page fault on it
+    volatile char stack[64 * 1024];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) stack[i] = 0;
+}
 
-    int result = modbus_read_registers(this->_p->ctx, start_address, num_registers, data);
+// Sleep until an absolute steady_clock time (CLOCK_MONOTONIC on Linux): no drift from computing a relative delay
+static void sleepUntil(std::chrono::steady_clock::time_point t)
+{
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    timespec ts = {time_t(ns / 1000000000), long(ns % 1000000000)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR);
+}
 
-    if (result == -1) {
-        std::cerr << stdErrorMsg("get_all_update_bool()","Failed to read data",modbus_strerror(errno));
-        this->_p->spuData.STATE = 1;
-        this->_p->spuData.TIME = std::chrono::system_clock::now();
-        return this->_p->spuData;
-    }
+void libModbusSystematomSPU::pollLoop()
+{
+    using clock = std::chrono::steady_clock;
+    if (this->_p->realtime.enabled) applyRealtime(this->_p->realtime, this->_p->portname.c_str(), this->_p->slave);
+
+    // Everything the loop needs is allocated here, before the first cycle
+    const std::vector<SPU_SCHEDULE_GROUP>& groups = this->_p->schedule;
+    std::vector<clock::time_point> next(groups.size(), clock::now());
+    std::vector<bool> taken(groups.size());
+    std::vector<unsigned> deferred(groups.size());  // Cycles a due group was left out of
+
+    // Groups in the order they are served when the line cannot carry all of them
+    std::vector<size_t> order(groups.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return groups[a].priority > groups[b].priority; });
+
+    libModbusSystematomSPU_private::SAMPLE sample;     // Its data is the whole cache after every read
+    auto deadline = clock::now();   // When this cycle was due
+    while (this->_p->polling.load(std::memory_order_relaxed))
+    {
+        // Pack every due group in one plan; the fields of the others stay as last read. A lower-priority
+        // group waits for a later cycle if it would make this one longer than the period of the most urgent,
+        // unless it has already waited a whole period of its own: then it goes in anyway, so a line too slow
+        // for the urgent groups cannot starve the others.
+        auto now = clock::now();
+        this->_p->pollLateness.record(now - deadline);
+        this->_p->pollCycles.fetch_add(1, std::memory_order_relaxed);
+        uint32_t fields = 0;
+        std::chrono::microseconds budget{0};
+        for (size_t i : order)
+        {
+            taken[i] = false;
+            if (next[i] > now) continue;
+            uint32_t merged = fields | groups[i].fields;
+            bool starved = deferred[i] > 0 && now - next[i] >= groups[i].period;
+            if (!starved && fields != 0 && budget.count() > 0 && libModbusSystematomSPU_plan(merged, this->_p->cost).cost > budget.count())
+            {
+                deferred[i]++;
+                continue;
+            }
+            if (fields == 0) budget = groups[i].period;
+            deferred[i] = 0;
+            fields = merged;
+            taken[i] = true;
+        }
 
-    // Convert data in floats variables
-    this->_p->spuData.EMR_N           = data[0];
-    this->_p->spuData.WRN_N           = data[1];
-    this->_p->spuData.EMR_T           = data[2];
-    this->_p->spuData.WRN_T           = data[3];
-    this->_p->spuData.R1              = data[4];
-    this->_p->spuData.R2              = data[5];
-    this->_p->spuData.R3              = data[6];
-    this->_p->spuData.RDY             = data[7];
-    this->_p->spuData.TEST            = data[8];
-    this->_p->spuData.XXXX            = data[9];
-    this->_p->spuData.STATE           = 0;
-    this->_p->spuData.TIME = std::chrono::system_clock::now();
-    return this->_p->spuData;
- }
-
-
-float libModbusSystematomSPU::get_1_DATA_FP(int start_address)
-{
-    if (!this->_p->ctx || this->_p->flagNotConnected) {
-        std::cerr << stdErrorMsg("get_1_DATA_FP()","Modbus context does not exist","");
-        return -1;
+        int state = 0;
+        if (fields != 0)
+        {
+            auto start = clock::now();
+            state = exclusiveRead(fields, sample.data, "pollLoop()");
+            sample.acquired = clock::now();
+            this->_p->paths[SPU_PATH_POLL].record(sample.acquired - start);
+            this->_p->latest.store(sample);
+            if (budget.count() > 0 && sample.acquired > deadline + budget)
+                this->_p->deadlineMisses.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Late groups start over from now instead of catching up with a burst of reads
+        now = clock::now();
+        auto wake = clock::time_point::max();
+        for (size_t i = 0; i < groups.size(); i++)
+        {
+            if (taken[i])
+            {
+                next[i] += groups[i].period;
+                if (next[i] < now) next[i] = now;
+            }
+            wake = std::min(wake, next[i]);
+        }
+
+        // Without a device there is nothing to poll: retry slowly instead of spinning
+        if (state == 2) wake = std::max(wake, now + std::chrono::milliseconds(100));
+        deadline = std::max(wake, now);
+        if (wake > now) sleepUntil(wake);
     }
-    int num_registers = 0x02; // Number of registers to read
-    const int dataSize = 1 + num_registers - start_address; // Total number of bytes to read
-    uint16_t data[dataSize];
-    int result = modbus_read_registers(this->_p->ctx, start_address, num_registers, data);
-    if (result == -1) {
-        std::cerr << stdErrorMsg("get_1_DATA_FP()","Failed to read data",modbus_strerror(errno));
-        return -1;
+}
+
+bool libModbusSystematomSPU::startPolling(std::chrono::microseconds period, uint32_t fields)
+{
+    return startPolling({{fields, period, 0}});
+}
+
+bool libModbusSystematomSPU::startPolling(std::vector<SPU_SCHEDULE_GROUP> schedule, SPU_REALTIME realtime)
+{
+    if (this->_p->polling || schedule.empty()) return 1;
+    if (this->_p->poller.joinable()) this->_p->poller.join();   // A replay that reached its end
+    this->_p->schedule = std::move(schedule);
+    this->_p->realtime = realtime;
+
+    // Publish one sample of every group before returning so the getters never see an empty snapshot
+    uint32_t fields = 0;
+    for (const SPU_SCHEDULE_GROUP& group : this->_p->schedule) fields |= group.fields;
+    libModbusSystematomSPU_private::SAMPLE sample;
+    exclusiveRead(fields, sample.data, "startPolling()");
+    sample.acquired = std::chrono::steady_clock::now();
+    this->_p->latest.store(sample);
+
+    this->_p->polling = true;
+    this->_p->poller = std::thread(&libModbusSystematomSPU::pollLoop, this);
+    return 0;
+}
+
+void libModbusSystematomSPU::stopPolling()
+{
+    this->_p->polling = false;
+    if (this->_p->poller.joinable()) this->_p->poller.join();
+}
+
+bool libModbusSystematomSPU::isPolling() { return this->_p->polling; }
+
+bool libModbusSystematomSPU::startReplay(std::string journalPath, double speed)
+{
+    if (this->_p->polling) return 1;
+    if (this->_p->poller.joinable()) this->_p->poller.join();   // A replay that reached its end
+    auto journal = std::make_shared<libModbusSystematomSPU_journal_reader>(journalPath);
+    if (journal->size() == 0) {
+        libModbusSystematomSPU_report(SPU_ERROR_REPLAY, 0, "libModbusSystematomSPU", "startReplay()", journalPath.c_str(), this->_p->slave);
+        return 1;
     }
-    return conv2RegsToFloat(data[ 0], data[ 1]);
+
+    // The replay thread takes the place of the acquisition thread: getters read its snapshot
+    this->_p->polling = true;
+    this->_p->poller = std::thread([this, journal, speed]
+    {
+        auto start = std::chrono::steady_clock::now();
+        int64_t t0 = journal->record(0).time_ns;
+        libModbusSystematomSPU_private::SAMPLE sample;
+        for (uint64_t i = 0; i < journal->size() && this->_p->polling.load(std::memory_order_relaxed); i++)
+        {
+            if (speed > 0)
+                std::this_thread::sleep_until(start + std::chrono::nanoseconds(static_cast<int64_t>((journal->record(i).time_ns - t0) / speed)));
+            sample.data = journal->at(i);
+            sample.acquired = std::chrono::steady_clock::now();
+            this->_p->latest.store(sample);
+            publish(sample.data);
+        }
+        // The whole journal was played: isPolling() turns false and a new replay or polling may start
+        this->_p->polling = false;
+    });
+    return 0;
+}
+
+SPU_METRICS libModbusSystematomSPU::get_metrics()
+{
+    SPU_METRICS m;
+    for (int i = 0; i < SPU_PATH_COUNT; i++) m.paths[i] = this->_p->paths[i].snapshot();
+    m.samples       = this->_p->samples.load(std::memory_order_relaxed);
+    m.failedSamples = this->_p->failedSamples.load(std::memory_order_relaxed);
+    m.pollLateness   = this->_p->pollLateness.snapshot();
+    m.pollCycles     = this->_p->pollCycles.load(std::memory_order_relaxed);
+    m.deadlineMisses = this->_p->deadlineMisses.load(std::memory_order_relaxed);
+
+    // The window only moves with new samples: once it is overdue, the rate is what arrived since it began
+    int64_t now   = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t start = this->_p->rateStart.load(std::memory_order_relaxed);
+    m.samplesPerSecond = this->_p->rate.load(std::memory_order_relaxed);
+    if (start != 0 && now - start >= 2000000000)
+        m.samplesPerSecond = (m.samples - this->_p->rateSamples.load(std::memory_order_relaxed)) * 1e9 / (now - start);
+
+    m.bus = this->_p->bus->get_metrics();
+    return m;
+}
+
+std::string libModbusSystematomSPU::get_prometheus()
+{
+    return libModbusSystematomSPU_prometheus(get_metrics(), "port=\"" + get_portname() + "\",slave=\"" + std::to_string(this->_p->slave) + "\"");
 }
 
-uint16_t libModbusSystematomSPU::get_1_DATA(int address)
+static void prometheusHistogram(std::string& out, const char* name, const std::string& labels, const SPU_HISTOGRAM& h)
 {
-    if (!this->_p->ctx || this->_p->flagNotConnected) {
-        std::cerr << stdErrorMsg("get_1_DATA()","Modbus context does not exist","");
-        return -1;
+    // Cumulative buckets in seconds; bucket k ends at 2^k µs
+    std::string sep = labels.empty() ? "" : ",";
+    uint64_t cumulative = 0;
+    for (int k = 0; k < SPU_HISTOGRAM_BUCKETS - 1; k++)
+    {
+        cumulative += h.buckets[k];
+        out += std::string(name) + "_bucket{" + labels + sep + "le=\"" + std::to_string((1ull << k) * 1e-6) + "\"} " + std::to_string(cumulative) + "\n";
     }
-    uint16_t data[1];
-    int result = modbus_read_registers(this->_p->ctx, address, 0x01, data);
-    if (result == -1) {
-        std::cerr << stdErrorMsg("get_1_DATA()","Failed to read data",modbus_strerror(errno));
-        return -1;
+    out += std::string(name) + "_bucket{" + labels + sep + "le=\"+Inf\"} " + std::to_string(h.count) + "\n";
+    out += std::string(name) + "_sum{" + labels + "} " + std::to_string(h.sum_us * 1e-6) + "\n";
+    out += std::string(name) + "_count{" + labels + "} " + std::to_string(h.count) + "\n";
+}
+
+std::string libModbusSystematomSPU_prometheus(const SPU_METRICS& m, const std::string& labels)
+{
+    static const char* pathNames[SPU_PATH_COUNT] = {"get_all", "get_all_update_NT", "get_all_update_F", "get_all_update_NTF",
+                                                    "get_all_update_bool", "get_fields", "getter", "poll"};
+    std::string sep = labels.empty() ? "" : ",";
+    std::string out;
+
+    out += "# HELP spu_read_duration_seconds Time of a read as seen by the caller.\n";
+    out += "# TYPE spu_read_duration_seconds histogram\n";
+    for (int i = 0; i < SPU_PATH_COUNT; i++)
+        prometheusHistogram(out, "spu_read_duration_seconds", labels + sep + "path=\"" + pathNames[i] + "\"", m.paths[i]);
+
+    out += "# HELP spu_transaction_duration_seconds One Modbus transaction on the line, retries included.\n";
+    out += "# TYPE spu_transaction_duration_seconds histogram\n";
+    prometheusHistogram(out, "spu_transaction_duration_seconds", labels, m.bus.transaction);
+
+    out += "# HELP spu_poll_lateness_seconds How late the polling thread woke up for a cycle.\n";
+    out += "# TYPE spu_poll_lateness_seconds histogram\n";
+    prometheusHistogram(out, "spu_poll_lateness_seconds", labels, m.pollLateness);
+
+    auto counter = [&](const char* name, const char* help, uint64_t value)
+    {
+        out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " counter\n";
+        out += std::string(name) + "{" + labels + "} " + std::to_string(value) + "\n";
+    };
+    counter("spu_samples_total",                "Acquisitions with STATE 0.",                   m.samples);
+    counter("spu_failed_samples_total",         "Acquisitions with STATE 1 or 2.",              m.failedSamples);
+    counter("spu_transactions_total",           "Modbus transactions on the line.",             m.bus.transactions);
+    counter("spu_transaction_failures_total",   "Transactions failing after every retry.",      m.bus.failures);
+    counter("spu_timeouts_total",               "Attempts without a complete answer.",          m.bus.timeouts);
+    counter("spu_crc_errors_total",             "Answers with a wrong CRC.",                    m.bus.crcErrors);
+    counter("spu_exceptions_total",             "Exception answers of the SPU.",                m.bus.exceptions);
+    counter("spu_other_errors_total",           "Other failed attempts.",                       m.bus.otherErrors);
+    counter("spu_retries_total",                "Repeated attempts.",                           m.bus.retries);
+    counter("spu_reconnects_total",             "Reconnections of the line.",                   m.bus.reconnects);
+    counter("spu_poll_cycles_total",            "Cycles of the polling thread.",                m.pollCycles);
+    counter("spu_deadline_misses_total",        "Polling cycles ending after their period.",    m.deadlineMisses);
+
+    out += "# HELP spu_samples_per_second Successful acquisitions per second.\n# TYPE spu_samples_per_second gauge\n";
+    out += "spu_samples_per_second{" + labels + "} " + std::to_string(m.samplesPerSecond) + "\n";
+    return out;
+}
+
+void libModbusSystematomSPU::publish(const SPU_DATA& data)
+{
+    std::shared_ptr<const libModbusSystematomSPU_private::CALLBACKS> callbacks;
+    {
+        std::lock_guard<std::mutex> lock(this->_p->subscribersMtx);
+        auto& streams = this->_p->streams;
+        for (size_t i = 0; i < streams.size(); i++)
+        {
+            // Nobody else holds the stream any more: stop feeding it
+            if (streams[i].use_count() == 1) { streams.erase(streams.begin() + i--); continue; }
+            streams[i]->push(data);
+        }
+        callbacks = this->_p->callbacks;
     }
-    return *data;
-}
-
-float libModbusSystematomSPU::get_N_DATA_FP()       {return get_1_DATA_FP(0x01);}
-float libModbusSystematomSPU::get_T_DATA_FP()       {return get_1_DATA_FP(0x03);}
-float libModbusSystematomSPU::get_F1_DATA_FP()      {return get_1_DATA_FP(0x05);}
-float libModbusSystematomSPU::get_F2_DATA_FP()      {return get_1_DATA_FP(0x07);}
-float libModbusSystematomSPU::get_F3_DATA_FP()      {return get_1_DATA_FP(0x09);}
-float libModbusSystematomSPU::get_EMR_N_THRESHOLD() {return get_1_DATA_FP(0x0B);}
-float libModbusSystematomSPU::get_WRN_N_THRESHOLD() {return get_1_DATA_FP(0x0D);}
-float libModbusSystematomSPU::get_EMR_T_THRESHOLD() {return get_1_DATA_FP(0x0F);}
-float libModbusSystematomSPU::get_WRN_T_THRESHOLD() {return get_1_DATA_FP(0x11);}
-bool  libModbusSystematomSPU::get_EMR_N()           {return get_1_DATA(0x64);}
-bool  libModbusSystematomSPU::get_WRN_N()           {return get_1_DATA(0x65);}
-bool  libModbusSystematomSPU::get_EMR_T()           {return get_1_DATA(0x66);}
-bool  libModbusSystematomSPU::get_WRN_T()           {return get_1_DATA(0x67);}
-bool  libModbusSystematomSPU::get_R1()              {return get_1_DATA(0x68);}
-bool  libModbusSystematomSPU::get_R2()              {return get_1_DATA(0x69);}
-bool  libModbusSystematomSPU::get_R3()              {return get_1_DATA(0x70);}
-bool  libModbusSystematomSPU::get_RDY()             {return get_1_DATA(0x71);}
-bool  libModbusSystematomSPU::get_TEST()            {return get_1_DATA(0x72);}
-bool  libModbusSystematomSPU::get_XXXX()            {return get_1_DATA(0x73);}
+    // Outside the lock: a callback may add or remove callbacks, and a slow one does not hold up other readers
+    for (auto& callback : *callbacks) callback.second(data);
+}
+
+std::shared_ptr<libModbusSystematomSPU_stream> libModbusSystematomSPU::subscribe(size_t capacity)
+{
+    auto stream = std::make_shared<libModbusSystematomSPU_stream>(capacity);
+    std::lock_guard<std::mutex> lock(this->_p->subscribersMtx);
+    this->_p->streams.push_back(stream);
+    return stream;
+}
+
+void libModbusSystematomSPU::unsubscribe(const std::shared_ptr<libModbusSystematomSPU_stream>& stream)
+{
+    std::lock_guard<std::mutex> lock(this->_p->subscribersMtx);
+    auto& streams = this->_p->streams;
+    streams.erase(std::remove(streams.begin(), streams.end(), stream), streams.end());
+}
+
+int libModbusSystematomSPU::add_sample_callback(std::function<void(const SPU_DATA&)> callback)
+{
+    std::lock_guard<std::mutex> lock(this->_p->subscribersMtx);
+    auto callbacks = std::make_shared<libModbusSystematomSPU_private::CALLBACKS>(*this->_p->callbacks);
+    callbacks->emplace_back(this->_p->nextCallbackId, callback);
+    this->_p->callbacks = callbacks;
+    return this->_p->nextCallbackId++;
+}
+
+void libModbusSystematomSPU::remove_sample_callback(int id)
+{
+    std::lock_guard<std::mutex> lock(this->_p->subscribersMtx);
+    auto callbacks = std::make_shared<libModbusSystematomSPU_private::CALLBACKS>(*this->_p->callbacks);
+    callbacks->erase(std::remove_if(callbacks->begin(), callbacks->end(), [id](auto& c){ return c.first == id; }), callbacks->end());
+    this->_p->callbacks = callbacks;
+}
+
+SPU_DATA libModbusSystematomSPU::get_all()
+{
+    SPU_DATA data;
+    readFields(SPU_FIELD_ALL, SPU_PATH_GET_ALL, "get_all()", data);
+    return data;
+}
+
+SPU_DATA libModbusSystematomSPU::get_all_update_NT()
+{
+    SPU_DATA data;
+    readFields(SPU_FIELD_NT, SPU_PATH_UPDATE_NT, "get_all_update_NT()", data);
+    return data;
+}
+
+SPU_DATA libModbusSystematomSPU::get_all_update_NTF()
+{
+    SPU_DATA data;
+    readFields(SPU_FIELD_NTF, SPU_PATH_UPDATE_NTF, "get_all_update_NTF()", data);
+    return data;
+}
+
+SPU_DATA libModbusSystematomSPU::get_all_update_F()
+{
+    SPU_DATA data;
+    readFields(SPU_FIELD_F, SPU_PATH_UPDATE_F, "get_all_update_F()", data);
+    return data;
+}
+
+SPU_DATA libModbusSystematomSPU::get_all_update_bool()
+{
+    SPU_DATA data;
+    readFields(SPU_FIELD_BOOL, SPU_PATH_UPDATE_BOOL, "get_all_update_bool()", data);
+    return data;
+}
+
+SPU_DATA libModbusSystematomSPU::get_fields(uint32_t fields)
+{
+    SPU_DATA data;
+    readFields(fields, SPU_PATH_GET_FIELDS, "get_fields()", data);
+    return data;
+}
+
+SPU_DATA libModbusSystematomSPU::get_all(std::chrono::microseconds maxAge)
+{
+    SPU_DATA data;
+    readFields(SPU_FIELD_ALL, SPU_PATH_GET_ALL, "get_all()", data, maxAge);
+    return data;
+}
+
+SPU_DATA libModbusSystematomSPU::get_fields(uint32_t fields, std::chrono::microseconds maxAge)
+{
+    SPU_DATA data;
+    readFields(fields, SPU_PATH_GET_FIELDS, "get_fields()", data, maxAge);
+    return data;
+}
+
+void          libModbusSystematomSPU::set_read_cost(SPU_READ_COST cost)
+{
+    this->_p->cost = cost;
+    for (auto& p : this->_p->plans) p.valid = false;
+}
+SPU_READ_COST libModbusSystematomSPU::get_read_cost()                   { return this->_p->cost; }
+SPU_READ_PLAN libModbusSystematomSPU::plan(uint32_t fields)             { return libModbusSystematomSPU_plan(fields, this->_p->cost); }
+
+// One field read through the planner; a failed read gives -1, or true for the flags (fail-safe)
+template <SPU_FIELD F>
+auto libModbusSystematomSPU::getField(const char* functionName)
+{
+    constexpr const SPU_FIELD_MAP& f = fieldMap<F>();
+    SPU_DATA data;
+    bool failed = readFields(F, SPU_PATH_GETTER, functionName, data);
+    if constexpr (f.fp != nullptr) return failed ? -1.f : data.*f.fp;
+    else                           return failed ? true : data.*f.i16 != 0;
+}
+
+float libModbusSystematomSPU::get_N_DATA_FP()       {return getField<SPU_FIELD_N_DATA_FP>(       "get_N_DATA_FP()");}
+float libModbusSystematomSPU::get_T_DATA_FP()       {return getField<SPU_FIELD_T_DATA_FP>(       "get_T_DATA_FP()");}
+float libModbusSystematomSPU::get_F1_DATA_FP()      {return getField<SPU_FIELD_F1_DATA_FP>(      "get_F1_DATA_FP()");}
+float libModbusSystematomSPU::get_F2_DATA_FP()      {return getField<SPU_FIELD_F2_DATA_FP>(      "get_F2_DATA_FP()");}
+float libModbusSystematomSPU::get_F3_DATA_FP()      {return getField<SPU_FIELD_F3_DATA_FP>(      "get_F3_DATA_FP()");}
+float libModbusSystematomSPU::get_EMR_N_THRESHOLD() {return getField<SPU_FIELD_EMR_N_THRESHOLD>( "get_EMR_N_THRESHOLD()");}
+float libModbusSystematomSPU::get_WRN_N_THRESHOLD() {return getField<SPU_FIELD_WRN_N_THRESHOLD>( "get_WRN_N_THRESHOLD()");}
+float libModbusSystematomSPU::get_EMR_T_THRESHOLD() {return getField<SPU_FIELD_EMR_T_THRESHOLD>( "get_EMR_T_THRESHOLD()");}
+float libModbusSystematomSPU::get_WRN_T_THRESHOLD() {return getField<SPU_FIELD_WRN_T_THRESHOLD>( "get_WRN_T_THRESHOLD()");}
+bool  libModbusSystematomSPU::get_EMR_N()           {return getField<SPU_FIELD_EMR_N>(           "get_EMR_N()");}
+bool  libModbusSystematomSPU::get_WRN_N()           {return getField<SPU_FIELD_WRN_N>(           "get_WRN_N()");}
+bool  libModbusSystematomSPU::get_EMR_T()           {return getField<SPU_FIELD_EMR_T>(           "get_EMR_T()");}
+bool  libModbusSystematomSPU::get_WRN_T()           {return getField<SPU_FIELD_WRN_T>(           "get_WRN_T()");}
+bool  libModbusSystematomSPU::get_R1()              {return getField<SPU_FIELD_R1>(              "get_R1()");}
+bool  libModbusSystematomSPU::get_R2()              {return getField<SPU_FIELD_R2>(              "get_R2()");}
+bool  libModbusSystematomSPU::get_R3()              {return getField<SPU_FIELD_R3>(              "get_R3()");}
+bool  libModbusSystematomSPU::get_RDY()             {return getField<SPU_FIELD_RDY>(             "get_RDY()");}
+bool  libModbusSystematomSPU::get_TEST()            {return getField<SPU_FIELD_TEST>(            "get_TEST()");}
+bool  libModbusSystematomSPU::get_XXXX()            {return getField<SPU_FIELD_XXXX>(            "get_XXXX()");}
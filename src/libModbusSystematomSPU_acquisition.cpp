@@ -0,0 +1,166 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024 Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <libModbusSystematomSPU_acquisition.h>
+
+#include <algorithm>
+#include <atomic>
+#include <barrier>
+#include <future>
+#include <mutex>
+#include <thread>
+
+struct libModbusSystematomSPU_acquisition_private;
+
+// Runs once per cycle, in one of the workers, while all the others are held at the barrier
+struct SPU_CYCLE_END
+{
+    libModbusSystematomSPU_acquisition_private* p;
+    void operator()() noexcept;
+};
+
+struct libModbusSystematomSPU_acquisition_private {
+    std::vector<std::shared_ptr<libModbusSystematomSPU>> channels;
+    std::vector<std::thread> workers;
+    std::unique_ptr<std::barrier<SPU_CYCLE_END>> barrier;
+    std::atomic<bool> stopRequested{false};
+    bool running = false;  // Only written inside the barrier completion
+    std::chrono::microseconds period{0};
+    uint32_t fields = SPU_FIELD_ALL;
+
+    SPU_FUSED pending;     // Filled by the workers, each one in its own slot
+    bool havePending = false;
+
+    std::mutex mtx;
+    SPU_FUSED latest;
+    std::function<void(const SPU_FUSED&)> callback;
+};
+
+void SPU_CYCLE_END::operator()() noexcept
+{
+    SPU_FUSED& f = p->pending;
+    if (p->havePending)
+    {
+        auto [first, last] = std::minmax_element(f.ACQUIRED.begin(), f.ACQUIRED.end());
+        f.WINDOW = *last - *first;
+        f.SEQ++;
+
+        std::lock_guard<std::mutex> lock(p->mtx);
+        p->latest = f;
+        if (p->callback) p->callback(p->latest);
+    }
+
+    if (p->stopRequested.load(std::memory_order_relaxed))
+    {
+        p->running = false;
+        return;
+    }
+
+    // Release every channel at the same instant
+    if (p->havePending && p->period.count() > 0)
+        std::this_thread::sleep_until(std::max(f.START + p->period, std::chrono::steady_clock::now()));
+    f.START = std::chrono::steady_clock::now();
+    p->havePending = true;
+}
+
+libModbusSystematomSPU_acquisition::libModbusSystematomSPU_acquisition(std::vector<std::string> portnames)
+{
+    this->_p = new libModbusSystematomSPU_acquisition_private;
+
+    std::vector<std::future<std::shared_ptr<libModbusSystematomSPU>>> opening;
+    for (const std::string& portname : portnames)
+        opening.push_back(std::async(std::launch::async, [portname]{ return std::make_shared<libModbusSystematomSPU>(portname); }));
+    for (auto& channel : opening) this->_p->channels.push_back(channel.get());
+}
+
+libModbusSystematomSPU_acquisition::libModbusSystematomSPU_acquisition(std::vector<std::shared_ptr<libModbusSystematomSPU>> channels)
+{
+    this->_p = new libModbusSystematomSPU_acquisition_private;
+    this->_p->channels = channels;
+}
+
+libModbusSystematomSPU_acquisition::~libModbusSystematomSPU_acquisition()
+{
+    stop();
+    delete this->_p;
+}
+
+bool libModbusSystematomSPU_acquisition::start(std::chrono::microseconds period, uint32_t fields)
+{
+    size_t n = this->_p->channels.size();
+    if (!this->_p->workers.empty() || n == 0) return 1;
+
+    this->_p->period = period;
+    this->_p->fields = fields;
+    this->_p->stopRequested = false;
+    this->_p->running = true;
+    this->_p->havePending = false;
+    this->_p->pending.CHANNELS.assign(n, SPU_DATA());
+    this->_p->pending.ACQUIRED.assign(n, std::chrono::steady_clock::time_point());
+    this->_p->barrier = std::make_unique<std::barrier<SPU_CYCLE_END>>(n, SPU_CYCLE_END{this->_p});
+
+    for (size_t i = 0; i < n; i++)
+    {
+        this->_p->workers.emplace_back([p = this->_p, i]
+        {
+            libModbusSystematomSPU& channel = *p->channels[i];
+            for (;;)
+            {
+                p->barrier->arrive_and_wait();
+                if (!p->running) break;
+
+                auto t0 = std::chrono::steady_clock::now();
+                SPU_DATA data = channel.get_fields(p->fields);
+                auto t1 = std::chrono::steady_clock::now();
+                p->pending.CHANNELS[i] = data;
+                p->pending.ACQUIRED[i] = t0 + (t1 - t0) / 2;
+            }
+        });
+    }
+    return 0;
+}
+
+void libModbusSystematomSPU_acquisition::stop()
+{
+    this->_p->stopRequested = true;
+    for (std::thread& worker : this->_p->workers) worker.join();
+    this->_p->workers.clear();
+    this->_p->barrier.reset();
+}
+
+bool libModbusSystematomSPU_acquisition::isRunning() { return !this->_p->workers.empty(); }
+
+SPU_FUSED libModbusSystematomSPU_acquisition::get_fused()
+{
+    std::lock_guard<std::mutex> lock(this->_p->mtx);
+    return this->_p->latest;
+}
+
+void libModbusSystematomSPU_acquisition::set_callback(std::function<void(const SPU_FUSED&)> callback)
+{
+    std::lock_guard<std::mutex> lock(this->_p->mtx);
+    this->_p->callback = callback;
+}
+
+size_t libModbusSystematomSPU_acquisition::get_channel_count() { return this->_p->channels.size(); }
+
+std::shared_ptr<libModbusSystematomSPU> libModbusSystematomSPU_acquisition::get_channel(size_t index)
+{
+    return this->_p->channels.at(index);
+}
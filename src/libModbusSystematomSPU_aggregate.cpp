@@ -0,0 +1,248 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024 Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <libModbusSystematomSPU_aggregate.h>
+
+#include <algorithm>
+#include <bit>
+#include <climits>
+#include <mutex>
+
+using namespace std::chrono;
+
+constexpr int64_t RESOLUTION_NS[SPU_RESOLUTION_COUNT] = {1000000000LL, 60000000000LL, 3600000000000LL};
+
+void SPU_RUNNING_STATS::add(float x)
+{
+    if (count == 0) min = max = x;
+    min = std::min(min, x);
+    max = std::max(max, x);
+    count++;
+    double d = x - mean;
+    mean += d / count;
+    m2   += d * (x - mean);
+}
+
+void SPU_RUNNING_STATS::merge(const SPU_RUNNING_STATS& other)
+{
+    if (other.count == 0) return;
+    if (count == 0) { *this = other; return; }
+    uint64_t n = count + other.count;
+    double d = other.mean - mean;
+    mean += d * other.count / n;
+    m2   += other.m2 + d * d * (double(count) * other.count / n);
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+    count = n;
+}
+
+double SPU_AGGREGATE::dutyCycle(SPU_FIELD flag) const
+{
+    int k = std::countr_zero(uint32_t(flag)) - 9;
+    if (k < 0 || k >= 10 || covered.count() == 0) return 0;
+    return double(flagOn[k].count()) / covered.count();
+}
+
+void SPU_AGGREGATE::merge(const SPU_AGGREGATE& other)
+{
+    if (end <= start) { start = other.start; end = other.end; }
+    else if (other.end > other.start)
+    {
+        start = std::min(start, other.start);
+        end   = std::max(end, other.end);
+    }
+    covered   += other.covered;
+    N.merge(other.N);
+    T.merge(other.T);
+    aboveWrnN += other.aboveWrnN;
+    aboveEmrN += other.aboveEmrN;
+    aboveWrnT += other.aboveWrnT;
+    aboveEmrT += other.aboveEmrT;
+    for (int k = 0; k < 10; k++) flagOn[k] += other.flagOn[k];
+}
+
+// Buckets of one resolution: bucket index i (time / width) lives in slot i % capacity, tagged with i
+struct SPU_AGGREGATE_RING
+{
+    int64_t width = 0;
+    std::vector<int64_t> keys;
+    std::vector<SPU_AGGREGATE> slots;
+
+    static SPU_AGGREGATE empty(int64_t index, int64_t width)
+    {
+        SPU_AGGREGATE a;
+        a.start = system_clock::time_point(duration_cast<system_clock::duration>(nanoseconds(index * width)));
+        a.end   = system_clock::time_point(duration_cast<system_clock::duration>(nanoseconds((index + 1) * width)));
+        return a;
+    }
+
+    SPU_AGGREGATE& bucket(int64_t index)
+    {
+        size_t slot = size_t(index) % slots.size();
+        if (keys[slot] != index)
+        {
+            keys[slot]  = index;
+            slots[slot] = empty(index, width);
+        }
+        return slots[slot];
+    }
+
+    SPU_AGGREGATE get(int64_t index)
+    {
+        size_t slot = size_t(index) % slots.size();
+        return keys[slot] == index ? slots[slot] : empty(index, width);
+    }
+};
+
+struct libModbusSystematomSPU_aggregator_private
+{
+    std::mutex mtx;
+    SPU_AGGREGATE_RING rings[SPU_RESOLUTION_COUNT];
+    int64_t maxGap;
+
+    bool       hasPrev = false;     // prev holds until the next sample
+    SPU_RECORD prev;
+    int64_t    lastNs  = INT64_MIN;
+
+    // Oldest bucket index still held by ring r (nothing is held before the first sample)
+    int64_t oldest(int r)
+    {
+        if (lastNs == INT64_MIN) return INT64_MAX;
+        return lastNs / rings[r].width - int64_t(rings[r].slots.size()) + 1;
+    }
+
+    void hold(int64_t from, int64_t to);
+};
+
+// Account the values of prev over [from, to), split at the bucket boundaries of every resolution
+void libModbusSystematomSPU_aggregator_private::hold(int64_t from, int64_t to)
+{
+    const float N = prev.fp[0], T = prev.fp[1];
+    const float emrN = prev.fp[5], wrnN = prev.fp[6], emrT = prev.fp[7], wrnT = prev.fp[8];
+    const uint16_t on = prev.flags & prev.flagsKnown;
+    for (SPU_AGGREGATE_RING& ring : rings)
+    {
+        for (int64_t s = from; s < to; )
+        {
+            int64_t index = s / ring.width;
+            int64_t e = std::min(to, (index + 1) * ring.width);
+            nanoseconds dt(e - s);
+            SPU_AGGREGATE& a = ring.bucket(index);
+            a.covered += dt;
+            // A threshold never read stays at -1 and does not count
+            if (wrnN >= 0 && N > wrnN) a.aboveWrnN += dt;
+            if (emrN >= 0 && N > emrN) a.aboveEmrN += dt;
+            if (wrnT >= 0 && T > wrnT) a.aboveWrnT += dt;
+            if (emrT >= 0 && T > emrT) a.aboveEmrT += dt;
+            for (uint16_t bits = on; bits; bits &= bits - 1) a.flagOn[std::countr_zero(bits)] += dt;
+            s = e;
+        }
+    }
+}
+
+libModbusSystematomSPU_aggregator::libModbusSystematomSPU_aggregator(size_t seconds, size_t minutes, size_t hours,
+                                                                     nanoseconds maxGap)
+{
+    this->_p = new libModbusSystematomSPU_aggregator_private;
+    size_t capacity[SPU_RESOLUTION_COUNT] = {seconds, minutes, hours};
+    for (int r = 0; r < SPU_RESOLUTION_COUNT; r++)
+    {
+        this->_p->rings[r].width = RESOLUTION_NS[r];
+        this->_p->rings[r].keys.assign(std::max<size_t>(capacity[r], 1), INT64_MIN);
+        this->_p->rings[r].slots.resize(std::max<size_t>(capacity[r], 1));
+    }
+    this->_p->maxGap = maxGap.count();
+}
+
+libModbusSystematomSPU_aggregator::~libModbusSystematomSPU_aggregator()
+{
+    delete this->_p;
+}
+
+bool libModbusSystematomSPU_aggregator::add(const SPU_DATA& data)
+{
+    std::lock_guard<std::mutex> lock(this->_p->mtx);
+    if (data.STATE != 0)
+    {
+        this->_p->hasPrev = false;
+        return 1;
+    }
+
+    SPU_RECORD record = libModbusSystematomSPU_pack(data);
+    int64_t t = std::max(record.time_ns, this->_p->lastNs);
+    if (this->_p->hasPrev && t - this->_p->lastNs <= this->_p->maxGap) this->_p->hold(this->_p->lastNs, t);
+
+    for (SPU_AGGREGATE_RING& ring : this->_p->rings)
+    {
+        SPU_AGGREGATE& a = ring.bucket(t / ring.width);
+        a.N.add(record.fp[0]);
+        a.T.add(record.fp[1]);
+    }
+    this->_p->prev    = record;
+    this->_p->hasPrev = true;
+    this->_p->lastNs  = t;
+    return 0;
+}
+
+SPU_AGGREGATE libModbusSystematomSPU_aggregator::query(system_clock::time_point from, system_clock::time_point to)
+{
+    std::lock_guard<std::mutex> lock(this->_p->mtx);
+    SPU_AGGREGATE result;
+    const int64_t second = RESOLUTION_NS[SPU_RESOLUTION_SECOND];
+    int64_t f = duration_cast<nanoseconds>(from.time_since_epoch()).count();
+    int64_t e = duration_cast<nanoseconds>(to.time_since_epoch()).count();
+    if (this->_p->lastNs == INT64_MIN || e <= f) return result;
+
+    // Nothing lies before the oldest hour held or after the newest sample
+    f = std::max(f / second * second, this->_p->oldest(SPU_RESOLUTION_HOUR) * RESOLUTION_NS[SPU_RESOLUTION_HOUR]);
+    e = std::min((e + second - 1) / second * second, (this->_p->lastNs / second + 1) * second);
+
+    for (int64_t s = f; s < e; )
+    {
+        // The coarsest bucket starting at s and ending inside the range, else the finest one still held around s
+        int use = -1;
+        for (int r = SPU_RESOLUTION_COUNT - 1; r >= 0 && use < 0; r--)
+        {
+            int64_t w = this->_p->rings[r].width;
+            if (s % w == 0 && s + w <= e && s / w >= this->_p->oldest(r)) use = r;
+        }
+        for (int r = 0; r < SPU_RESOLUTION_COUNT && use < 0; r++)
+            if (s / this->_p->rings[r].width >= this->_p->oldest(r)) use = r;
+        if (use < 0) use = SPU_RESOLUTION_HOUR;
+
+        SPU_AGGREGATE_RING& ring = this->_p->rings[use];
+        int64_t index = s / ring.width;
+        result.merge(ring.get(index));
+        s = (index + 1) * ring.width;
+    }
+    return result;
+}
+
+size_t libModbusSystematomSPU_aggregator::buckets(SPU_RESOLUTION resolution, system_clock::time_point from,
+                                                  system_clock::time_point to, SPU_AGGREGATE* out, size_t max)
+{
+    std::lock_guard<std::mutex> lock(this->_p->mtx);
+    if (resolution < 0 || resolution >= SPU_RESOLUTION_COUNT) return 0;
+    SPU_AGGREGATE_RING& ring = this->_p->rings[resolution];
+    int64_t first = std::max(duration_cast<nanoseconds>(from.time_since_epoch()).count() / ring.width, this->_p->oldest(resolution));
+    int64_t last  = (duration_cast<nanoseconds>(to.time_since_epoch()).count() + ring.width - 1) / ring.width;
+    size_t n = 0;
+    for (int64_t index = first; index < last && n < max; index++) out[n++] = ring.get(index);
+    return n;
+}
@@ -0,0 +1,509 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024 Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <libModbusSystematomSPU_archive.h>
+#include <libModbusSystematomSPU_error.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char     ARCHIVE_MAGIC[8] = {'S','P','U','A','R','C','H','1'};
+static const uint32_t ARCHIVE_VERSION  = 1;
+static const size_t   ARCHIVE_PADDING  = 8;     // Zero bytes after a payload in memory, so the bit reader loads 8 at a time
+
+static uint32_t fnv1a(const uint8_t* p, size_t n)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static inline uint64_t zigzag(int64_t v)    { return (uint64_t(v) << 1) ^ uint64_t(v >> 63); }
+static inline int64_t  unzigzag(uint64_t u) { return int64_t(u >> 1) ^ -int64_t(u & 1); }
+
+// MSB-first bit stream
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<uint8_t>& out) : out(out) {}
+    void put(uint32_t v, int bits)          // bits <= 32
+    {
+        if (bits < 32) v &= (1u << bits) - 1;
+        acc = (acc << bits) | v;
+        n += bits;
+        while (n >= 8) { n -= 8; out.push_back(uint8_t(acc >> n)); }
+    }
+    void put64(uint64_t v) { put(uint32_t(v >> 32), 32); put(uint32_t(v), 32); }
+    void finish() { if (n > 0) out.push_back(uint8_t(acc << (8 - n))); n = 0; }
+private:
+    std::vector<uint8_t>& out;
+    uint64_t acc = 0;
+    int n = 0;
+};
+
+class BitReader {
+public:
+    BitReader(const uint8_t* p, size_t size) : p(p), size(size) {}
+    uint32_t get(int bits)                  // bits <= 32
+    {
+        if ((pos >> 3) + 8 > size + ARCHIVE_PADDING) { overrun = true; return 0; }
+        uint64_t w;
+        std::memcpy(&w, p + (pos >> 3), 8);
+        if constexpr (std::endian::native == std::endian::little) w = __builtin_bswap64(w);
+        w <<= pos & 7;
+        pos += bits;
+        return bits ? uint32_t(w >> (64 - bits)) : 0;
+    }
+    uint64_t get64() { uint64_t hi = get(32); return hi << 32 | get(32); }
+    bool ok() const { return !overrun && pos <= size * 8; }
+private:
+    const uint8_t* p;
+    size_t size;
+    size_t pos = 0;
+    bool overrun = false;
+};
+
+// Delta of delta in buckets of 1, 16, 27, 36 and 68 bits
+static void putDod(BitWriter& w, int64_t dod)
+{
+    uint64_t z = zigzag(dod);
+    if      (z == 0)              w.put(0, 1);
+    else if (z < (1u << 14))      { w.put(0x2, 2); w.put(z, 14); }
+    else if (z < (1u << 24))      { w.put(0x6, 3); w.put(z, 24); }
+    else if (z < (1ull << 32))    { w.put(0xE, 4); w.put(z, 32); }
+    else                          { w.put(0xF, 4); w.put64(z); }
+}
+
+static int64_t getDod(BitReader& r)
+{
+    if (!r.get(1)) return 0;
+    if (!r.get(1)) return unzigzag(r.get(14));
+    if (!r.get(1)) return unzigzag(r.get(24));
+    if (!r.get(1)) return unzigzag(r.get(32));
+    return unzigzag(r.get64());
+}
+
+template <typename T, typename Get>
+static void putIntegers(BitWriter& w, const SPU_RECORD* records, uint32_t n, Get get)
+{
+    w.put64(uint64_t(get(records[0])));
+    int64_t prevDelta = 0;
+    for (uint32_t i = 1; i < n; i++)
+    {
+        int64_t delta = int64_t(uint64_t(get(records[i])) - uint64_t(get(records[i-1])));
+        putDod(w, int64_t(uint64_t(delta) - uint64_t(prevDelta)));
+        prevDelta = delta;
+    }
+}
+
+template <typename T, typename Set>
+static void getIntegers(BitReader& r, SPU_RECORD* records, uint32_t n, Set set)
+{
+    uint64_t value = r.get64();
+    uint64_t delta = 0;
+    set(records[0], T(value));
+    for (uint32_t i = 1; i < n; i++)
+    {
+        delta += uint64_t(getDod(r));
+        value += delta;
+        set(records[i], T(value));
+    }
+}
+
+// Gorilla: '0' same value, '10' meaningful bits inside the previous window, '11' + 5-bit leading zeros +
+// 5-bit length - 1 + the bits
+static void putFloats(BitWriter& w, const SPU_RECORD* records, uint32_t n, int k)
+{
+    uint32_t prev = std::bit_cast<uint32_t>(records[0].fp[k]);
+    w.put(prev, 32);
+    int leading = -1, trailing = 0;
+    for (uint32_t i = 1; i < n; i++)
+    {
+        uint32_t cur = std::bit_cast<uint32_t>(records[i].fp[k]);
+        uint32_t x = cur ^ prev;
+        prev = cur;
+        if (x == 0) { w.put(0, 1); continue; }
+        int lz = std::countl_zero(x), tz = std::countr_zero(x);
+        if (leading >= 0 && lz >= leading && tz >= trailing)
+        {
+            w.put(0x2, 2);
+            w.put(x >> trailing, 32 - leading - trailing);
+            continue;
+        }
+        int meaningful = 32 - lz - tz;
+        w.put(0x3, 2);
+        w.put(lz, 5);
+        w.put(meaningful - 1, 5);
+        w.put(x >> tz, meaningful);
+        leading = lz;
+        trailing = tz;
+    }
+}
+
+static void getFloats(BitReader& r, SPU_RECORD* records, uint32_t n, int k)
+{
+    uint32_t value = r.get(32);
+    records[0].fp[k] = std::bit_cast<float>(value);
+    int leading = 0, trailing = 0;
+    for (uint32_t i = 1; i < n; i++)
+    {
+        if (r.get(1))
+        {
+            if (r.get(1))
+            {
+                leading = r.get(5);
+                trailing = 32 - leading - int(r.get(5) + 1);
+                if (trailing < 0) trailing = 0;
+            }
+            value ^= r.get(32 - leading - trailing) << trailing;
+        }
+        records[i].fp[k] = std::bit_cast<float>(value);
+    }
+}
+
+// State and flags: runs of identical (state, flags, flagsKnown)
+static uint64_t flagKey(const SPU_RECORD& r) { return uint64_t(uint8_t(r.state)) << 32 | uint32_t(r.flags) << 16 | r.flagsKnown; }
+
+static void putFlags(BitWriter& w, const SPU_RECORD* records, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; )
+    {
+        uint64_t key = flagKey(records[i]);
+        uint32_t run = 1;
+        while (i + run < n && flagKey(records[i + run]) == key) run++;
+        w.put(uint32_t(key >> 32), 8);
+        w.put(uint32_t(key), 32);
+        w.put(run - 1, 16);
+        i += run;
+    }
+}
+
+static void getFlags(BitReader& r, SPU_RECORD* records, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; )
+    {
+        int8_t   state = int8_t(r.get(8));
+        uint32_t flags = r.get(32);
+        uint32_t run   = std::min(r.get(16) + 1, n - i);
+        for (uint32_t j = 0; j < run; j++, i++)
+        {
+            records[i].state      = state;
+            records[i].flags      = uint16_t(flags >> 16);
+            records[i].flagsKnown = uint16_t(flags);
+        }
+        if (!r.ok()) return;
+    }
+}
+
+static void encodeBlock(const SPU_RECORD* records, uint32_t n, std::vector<uint8_t>& out)
+{
+    BitWriter w(out);
+    putIntegers<int64_t>(w, records, n, [](const SPU_RECORD& r) { return r.time_ns; });
+    putIntegers<uint64_t>(w, records, n, [](const SPU_RECORD& r) { return r.seq; });
+    putFlags(w, records, n);
+    for (int k = 0; k < 9; k++) putFloats(w, records, n, k);
+    w.finish();
+}
+
+// payload must be followed by ARCHIVE_PADDING readable bytes
+static bool decodeBlock(const uint8_t* payload, size_t size, uint32_t n, SPU_RECORD* records)
+{
+    BitReader r(payload, size);
+    std::fill(records, records + n, SPU_RECORD());
+    getIntegers<int64_t>(r, records, n, [](SPU_RECORD& rec, int64_t v) { rec.time_ns = v; });
+    getIntegers<uint64_t>(r, records, n, [](SPU_RECORD& rec, uint64_t v) { rec.seq = v; });
+    getFlags(r, records, n);
+    for (int k = 0; k < 9 && r.ok(); k++) getFloats(r, records, n, k);
+    return !r.ok();
+}
+
+// Index of the complete blocks from offset on; returns where the next block starts
+static uint64_t scanBlocks(int fd, uint64_t offset, uint64_t fileSize, std::vector<SPU_ARCHIVE_BLOCK>& index)
+{
+    SPU_ARCHIVE_BLOCK b;
+    while (offset + sizeof(b) <= fileSize && pread(fd, &b, sizeof(b), offset) == (ssize_t)sizeof(b))
+    {
+        if (b.magic != SPU_ARCHIVE_BLOCK_MAGIC || b.count == 0 || b.count > SPU_ARCHIVE_MAX_BLOCK ||
+            offset + sizeof(b) + b.payloadSize > fileSize) break;
+        b.offset = offset;
+        index.push_back(b);
+        offset += sizeof(b) + b.payloadSize;
+    }
+    return offset;
+}
+
+//////// Writer ////////
+
+struct libModbusSystematomSPU_archive_private {
+    std::string path;
+    int fd = -1;
+    uint32_t blockSamples = 4096;
+    std::vector<SPU_RECORD> pending;
+    std::vector<uint8_t> buffer;    // Header and payload of the block being written
+    uint64_t end = 0;               // Where the next block goes
+    uint64_t written = 0;           // Samples in the file
+    int64_t  lastNs = INT64_MIN;
+};
+
+libModbusSystematomSPU_archive::libModbusSystematomSPU_archive(std::string path, uint32_t blockSamples)
+{
+    this->_p = new libModbusSystematomSPU_archive_private;
+    this->_p->path = path;
+    this->_p->blockSamples = std::clamp<uint32_t>(blockSamples, 1, SPU_ARCHIVE_MAX_BLOCK);
+    this->_p->pending.reserve(this->_p->blockSamples);
+    this->_p->fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+    struct stat st;
+    SPU_ARCHIVE_HEADER header = {};
+    bool valid = this->_p->fd >= 0 && fstat(this->_p->fd, &st) == 0;
+    if (valid && st.st_size < (off_t)sizeof(header))
+    {
+        std::memcpy(header.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC));
+        header.version      = ARCHIVE_VERSION;
+        header.blockSamples = this->_p->blockSamples;
+        header.created_ns   = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        valid = ftruncate(this->_p->fd, 0) == 0 && pwrite(this->_p->fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+        this->_p->end = sizeof(header);
+    }
+    else if (valid)
+    {
+        if (pread(this->_p->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+            std::memcmp(header.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0)
+        {
+            errno = EINVAL;
+            valid = false;
+        }
+        else
+        {
+            // Continue after the last complete block; a torn one is overwritten
+            std::vector<SPU_ARCHIVE_BLOCK> index;
+            this->_p->end = scanBlocks(this->_p->fd, sizeof(header), st.st_size, index);
+            for (const SPU_ARCHIVE_BLOCK& b : index) this->_p->written += b.count;
+            if (!index.empty()) this->_p->lastNs = index.back().last_ns;
+            if (this->_p->end < (uint64_t)st.st_size) valid = ftruncate(this->_p->fd, this->_p->end) == 0;
+        }
+    }
+    if (!valid)
+    {
+        libModbusSystematomSPU_report(SPU_ERROR_ARCHIVE, errno, "libModbusSystematomSPU_archive", "libModbusSystematomSPU_archive()", path.c_str());
+        if (this->_p->fd >= 0) close(this->_p->fd);
+        this->_p->fd = -1;
+    }
+}
+
+libModbusSystematomSPU_archive::~libModbusSystematomSPU_archive()
+{
+    flush();
+    if (this->_p->fd >= 0) close(this->_p->fd);
+    delete this->_p;
+}
+
+bool        libModbusSystematomSPU_archive::isOpen()   { return this->_p->fd >= 0; }
+std::string libModbusSystematomSPU_archive::get_path() { return this->_p->path; }
+uint64_t    libModbusSystematomSPU_archive::size()     { return this->_p->written + this->_p->pending.size(); }
+
+bool libModbusSystematomSPU_archive::append(const SPU_DATA& data)
+{
+    if (this->_p->fd < 0) return 1;
+    SPU_RECORD record = libModbusSystematomSPU_pack(data);
+    record.time_ns = std::max(record.time_ns, this->_p->lastNs);
+    this->_p->lastNs = record.time_ns;
+    this->_p->pending.push_back(record);
+    if (this->_p->pending.size() >= this->_p->blockSamples) return writeBlock();
+    return 0;
+}
+
+bool libModbusSystematomSPU_archive::flush()
+{
+    if (this->_p->fd < 0 || this->_p->pending.empty()) return 0;
+    return writeBlock();
+}
+
+bool libModbusSystematomSPU_archive::writeBlock()
+{
+    const std::vector<SPU_RECORD>& records = this->_p->pending;
+    std::vector<uint8_t>& buffer = this->_p->buffer;
+    buffer.assign(sizeof(SPU_ARCHIVE_BLOCK), 0);
+    encodeBlock(records.data(), records.size(), buffer);
+
+    SPU_ARCHIVE_BLOCK b = {};
+    b.magic       = SPU_ARCHIVE_BLOCK_MAGIC;
+    b.count       = records.size();
+    b.first_ns    = records.front().time_ns;
+    b.last_ns     = records.back().time_ns;
+    b.firstSeq    = records.front().seq;
+    b.payloadSize = buffer.size() - sizeof(b);
+    b.checksum    = fnv1a(buffer.data() + sizeof(b), b.payloadSize);
+    std::memcpy(buffer.data(), &b, sizeof(b));
+
+    // Failed blocks are dropped: a broken disk must not make the acquisition side grow without bound
+    bool failed = pwrite(this->_p->fd, buffer.data(), buffer.size(), this->_p->end) != (ssize_t)buffer.size();
+    if (failed)
+        libModbusSystematomSPU_report(SPU_ERROR_ARCHIVE, errno, "libModbusSystematomSPU_archive", "writeBlock()", this->_p->path.c_str());
+    else
+    {
+        this->_p->end += buffer.size();
+        this->_p->written += b.count;
+    }
+    this->_p->pending.clear();
+    return failed;
+}
+
+//////// Reader ////////
+
+struct libModbusSystematomSPU_archive_reader_private {
+    std::string path;
+    int fd = -1;
+    std::vector<SPU_ARCHIVE_BLOCK> index;
+    std::vector<uint64_t> starts;   // Samples before block i
+    uint64_t end = sizeof(SPU_ARCHIVE_HEADER);
+    uint64_t bytes = 0;
+};
+
+libModbusSystematomSPU_archive_reader::libModbusSystematomSPU_archive_reader(std::string path)
+{
+    this->_p = new libModbusSystematomSPU_archive_reader_private;
+    this->_p->path = path;
+    this->_p->fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    SPU_ARCHIVE_HEADER header;
+    if (this->_p->fd < 0 || pread(this->_p->fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        std::memcmp(header.magic, ARCHIVE_MAGIC, sizeof(ARCHIVE_MAGIC)) != 0)
+    {
+        if (this->_p->fd >= 0) errno = EINVAL;
+        libModbusSystematomSPU_report(SPU_ERROR_ARCHIVE, errno, "libModbusSystematomSPU_archive_reader", "libModbusSystematomSPU_archive_reader()", path.c_str());
+        if (this->_p->fd >= 0) close(this->_p->fd);
+        this->_p->fd = -1;
+        return;
+    }
+    refresh();
+}
+
+libModbusSystematomSPU_archive_reader::~libModbusSystematomSPU_archive_reader()
+{
+    if (this->_p->fd >= 0) close(this->_p->fd);
+    delete this->_p;
+}
+
+bool libModbusSystematomSPU_archive_reader::isOpen() { return this->_p->fd >= 0; }
+
+void libModbusSystematomSPU_archive_reader::refresh()
+{
+    struct stat st;
+    if (this->_p->fd < 0 || fstat(this->_p->fd, &st) != 0) return;
+    this->_p->bytes = st.st_size;
+    size_t first = this->_p->index.size();
+    this->_p->end = scanBlocks(this->_p->fd, this->_p->end, st.st_size, this->_p->index);
+    for (size_t i = first; i < this->_p->index.size(); i++)
+        this->_p->starts.push_back(i == 0 ? 0 : this->_p->starts[i-1] + this->_p->index[i-1].count);
+}
+
+uint64_t libModbusSystematomSPU_archive_reader::size()
+{
+    return this->_p->index.empty() ? 0 : this->_p->starts.back() + this->_p->index.back().count;
+}
+size_t            libModbusSystematomSPU_archive_reader::blocks()       { return this->_p->index.size(); }
+SPU_ARCHIVE_BLOCK libModbusSystematomSPU_archive_reader::block(size_t i) { return this->_p->index[i]; }
+uint64_t          libModbusSystematomSPU_archive_reader::bytes()        { return this->_p->bytes; }
+
+// Decode one block into records (count of them) using buffer for the payload
+static bool readBlock(int fd, const SPU_ARCHIVE_BLOCK& b, std::vector<uint8_t>& buffer, SPU_RECORD* records)
+{
+    buffer.assign(b.payloadSize + ARCHIVE_PADDING, 0);
+    if (pread(fd, buffer.data(), b.payloadSize, b.offset + sizeof(SPU_ARCHIVE_BLOCK)) != (ssize_t)b.payloadSize) return 1;
+    if (fnv1a(buffer.data(), b.payloadSize) != b.checksum) { errno = EBADMSG; return 1; }
+    if (decodeBlock(buffer.data(), b.payloadSize, b.count, records)) { errno = EBADMSG; return 1; }
+    return 0;
+}
+
+bool libModbusSystematomSPU_archive_reader::decode(size_t i, std::vector<SPU_RECORD>& out)
+{
+    if (this->_p->fd < 0 || i >= this->_p->index.size()) return 1;
+    std::vector<uint8_t> buffer;
+    out.resize(this->_p->index[i].count);
+    if (readBlock(this->_p->fd, this->_p->index[i], buffer, out.data()))
+    {
+        libModbusSystematomSPU_report(SPU_ERROR_ARCHIVE, errno, "libModbusSystematomSPU_archive_reader", "decode()", this->_p->path.c_str());
+        out.clear();
+        return 1;
+    }
+    return 0;
+}
+
+std::vector<SPU_RECORD> libModbusSystematomSPU_archive_reader::query(std::chrono::system_clock::time_point from,
+                                                                     std::chrono::system_clock::time_point to, unsigned threads)
+{
+    std::vector<SPU_RECORD> out;
+    const std::vector<SPU_ARCHIVE_BLOCK>& index = this->_p->index;
+    int64_t f = std::chrono::duration_cast<std::chrono::nanoseconds>(from.time_since_epoch()).count();
+    int64_t t = std::chrono::duration_cast<std::chrono::nanoseconds>(to.time_since_epoch()).count();
+    if (this->_p->fd < 0 || t <= f) return out;
+
+    // Blocks are in time order: the range is [first block ending at or after f, first block starting at or after t)
+    size_t b0 = std::lower_bound(index.begin(), index.end(), f, [](const SPU_ARCHIVE_BLOCK& b, int64_t v) { return b.last_ns < v; }) - index.begin();
+    size_t b1 = std::lower_bound(index.begin() + b0, index.end(), t, [](const SPU_ARCHIVE_BLOCK& b, int64_t v) { return b.first_ns < v; }) - index.begin();
+    if (b0 >= b1) return out;
+
+    // Every block decodes straight to its place in out
+    uint64_t base = this->_p->starts[b0];
+    out.resize(this->_p->starts[b1 - 1] + index[b1 - 1].count - base);
+    std::vector<char> failed(b1 - b0, 0);
+    std::atomic<size_t> next{b0};
+    auto worker = [&]
+    {
+        std::vector<uint8_t> buffer;
+        for (size_t i; (i = next.fetch_add(1)) < b1; )
+            if (readBlock(this->_p->fd, index[i], buffer, out.data() + (this->_p->starts[i] - base)))
+            {
+                failed[i - b0] = 1;
+                libModbusSystematomSPU_report(SPU_ERROR_ARCHIVE, errno, "libModbusSystematomSPU_archive_reader", "query()", this->_p->path.c_str());
+            }
+    };
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<size_t>(threads, b1 - b0);
+    std::vector<std::thread> pool;
+    for (unsigned k = 1; k < threads; k++) pool.emplace_back(worker);
+    worker();
+    for (auto& th : pool) th.join();
+
+    // Drop the blocks that failed, then the samples of the edge blocks outside the range
+    if (std::find(failed.begin(), failed.end(), 1) != failed.end())
+    {
+        size_t w = 0;
+        for (size_t i = b0; i < b1; i++)
+        {
+            if (failed[i - b0]) continue;
+            uint64_t start = this->_p->starts[i] - base;
+            if (w != start) std::copy(out.begin() + start, out.begin() + start + index[i].count, out.begin() + w);
+            w += index[i].count;
+        }
+        out.resize(w);
+    }
+    auto last  = std::lower_bound(out.begin(), out.end(), t, [](const SPU_RECORD& r, int64_t v) { return r.time_ns < v; });
+    out.erase(last, out.end());
+    auto first = std::lower_bound(out.begin(), out.end(), f, [](const SPU_RECORD& r, int64_t v) { return r.time_ns < v; });
+    out.erase(out.begin(), first);
+    return out;
+}
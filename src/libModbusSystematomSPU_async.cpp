@@ -0,0 +1,439 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024 Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <libModbusSystematomSPU_async.h>
+#include <libModbusSystematomSPU_rtu.h>
+
+#include <modbus/modbus.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <termios.h>
+#include <unistd.h>
+
+struct SPU_ASYNC_REQUEST
+{
+    SPU_READ_PLAN plan;
+    int block = 0;          // Next block of the plan to send
+    std::function<void(const SPU_DATA&)> done;
+};
+
+// Everything below is only touched by the reactor thread, except through post()
+struct libModbusSystematomSPU_async_private {
+    std::shared_ptr<libModbusSystematomSPU_reactor> reactor;
+    libModbusSystematomSPU_reactor_private* r = nullptr;
+    std::string portname;
+    int slave;
+    int baudrate;
+    int fd    = -1;
+    int timer = -1;
+    std::atomic<bool> connected{false};
+    std::chrono::microseconds timeout;
+    std::chrono::microseconds t35;
+    SPU_READ_COST cost;
+
+    // Reopening the port after a hang-up, with the backoff and jitter of the bus supervisor
+    std::chrono::milliseconds backoff{0};
+    std::minstd_rand rng{std::random_device{}()};
+
+    enum { IDLE, WAIT_RESPONSE, GAP, RECONNECT } state = IDLE;
+    std::deque<SPU_ASYNC_REQUEST> queue;
+    uint8_t tx[SPU_RTU_REQUEST_SIZE];
+    uint8_t rx[SPU_RTU_MAX_FRAME_SIZE];
+    int rxLen = 0;
+    bool removed = false;   // Left the reactor: its events still in the current epoll batch are ignored
+
+    uint16_t regs[SPU_REGISTER_IMAGE_SIZE] = {};
+    SPU_DATA data;
+    unsigned long long seq = 0;
+};
+
+struct libModbusSystematomSPU_reactor_private {
+    int epfd   = -1;
+    int wakefd = -1;
+    std::thread thread;
+    std::atomic<bool> running{true};
+    bool orphaned = false;  // Destroyed from its own thread: the thread frees everything when it leaves
+
+    std::mutex mtx;
+    std::vector<std::function<void()>> commands; // Run in the reactor thread
+    std::vector<libModbusSystematomSPU_async_private*> retired; // Freed once the current epoll batch is done
+};
+
+// epoll tags: device pointer with the low bit telling the serial port from the timer
+static uint64_t tag(libModbusSystematomSPU_async_private* d, bool timer) { return reinterpret_cast<uintptr_t>(d) | (timer ? 1 : 0); }
+
+static void post(libModbusSystematomSPU_reactor_private* r, std::function<void()> command)
+{
+    {
+        std::lock_guard<std::mutex> lock(r->mtx);
+        r->commands.push_back(std::move(command));
+    }
+    uint64_t one = 1;
+    (void)!write(r->wakefd, &one, sizeof(one));
+}
+
+static void arm(libModbusSystematomSPU_async_private* d, std::chrono::microseconds after)
+{
+    struct itimerspec its = {};
+    long us = std::max<long>(after.count(), 1);
+    its.it_value.tv_sec  = us / 1000000;
+    its.it_value.tv_nsec = (us % 1000000) * 1000;
+    timerfd_settime(d->timer, 0, &its, nullptr);
+}
+
+static void disarm(libModbusSystematomSPU_async_private* d)
+{
+    struct itimerspec its = {};
+    timerfd_settime(d->timer, 0, &its, nullptr);
+}
+
+static void startNext(libModbusSystematomSPU_async_private* d);
+
+// Finish the request at the front of the queue, then keep the line silent for t3.5
+static void complete(libModbusSystematomSPU_async_private* d, int state)
+{
+    SPU_ASYNC_REQUEST request = std::move(d->queue.front());
+    d->queue.pop_front();
+
+    if (state == 0)
+    {
+        libModbusSystematomSPU_decode(d->regs, d->data, request.plan.fields);
+        d->data.SEQ = ++d->seq;
+    }
+    d->data.STATE = state;
+    d->data.TIME  = std::chrono::system_clock::now();
+    if (request.done) request.done(d->data);
+
+    if (d->fd < 0) { startNext(d); return; }
+    d->state = libModbusSystematomSPU_async_private::GAP;
+    arm(d, d->t35);
+}
+
+static void sendBlock(libModbusSystematomSPU_async_private* d)
+{
+    const SPU_ASYNC_REQUEST& request = d->queue.front();
+    const SPU_READ_BLOCK& block = request.plan.blocks[request.block];
+    libModbusSystematomSPU_rtu_request(d->tx, d->slave, block.start_address, block.num_registers);
+
+    tcflush(d->fd, TCIFLUSH);
+    d->rxLen = 0;
+    if (write(d->fd, d->tx, SPU_RTU_REQUEST_SIZE) != SPU_RTU_REQUEST_SIZE)
+    {
+        libModbusSystematomSPU_report(SPU_ERROR_SEND, errno, "libModbusSystematomSPU_async", "read_fields()", d->portname.c_str(), d->slave);
+        complete(d, 1);
+        return;
+    }
+    d->state = libModbusSystematomSPU_async_private::WAIT_RESPONSE;
+    arm(d, d->timeout);
+}
+
+static void startNext(libModbusSystematomSPU_async_private* d)
+{
+    while (!d->queue.empty())
+    {
+        // Without a port (reopening it or for good) nothing waits
+        if (d->fd < 0) { complete(d, 2); continue; }
+        if (d->state != libModbusSystematomSPU_async_private::IDLE) return;
+        if (d->queue.front().plan.numBlocks == 0) { complete(d, 0); continue; }
+        sendBlock(d);
+    }
+}
+
+static void reconnectLater(libModbusSystematomSPU_async_private* d)
+{
+    // Between half and all of the backoff, doubled after every failed attempt
+    const SPU_CONFIG defaults;
+    d->backoff = d->backoff.count() == 0 ? defaults.reconnectMin : std::min(d->backoff * 2, defaults.reconnectMax);
+    auto half = d->backoff / 2;
+    d->state = libModbusSystematomSPU_async_private::RECONNECT;
+    arm(d, half + std::chrono::milliseconds(std::uniform_int_distribution<long>(0, half.count())(d->rng)));
+}
+
+static bool watch(libModbusSystematomSPU_async_private* d)
+{
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = tag(d, false);
+    return epoll_ctl(d->r->epfd, EPOLL_CTL_ADD, d->fd, &ev) != 0;
+}
+
+// The port hung up (adapter unplugged) or failed: answer everything with STATE 2 and reopen it in the background
+static void lineDown(libModbusSystematomSPU_async_private* d, int err)
+{
+    libModbusSystematomSPU_report(SPU_ERROR_NO_CONTEXT, err, "libModbusSystematomSPU_async", "onReadable()", d->portname.c_str(), d->slave);
+    epoll_ctl(d->r->epfd, EPOLL_CTL_DEL, d->fd, nullptr);
+    close(d->fd);
+    d->fd = -1;
+    d->connected = false;
+    d->backoff = std::chrono::milliseconds(0);
+    disarm(d);
+    d->state = libModbusSystematomSPU_async_private::IDLE;
+    startNext(d);
+    reconnectLater(d);
+}
+
+static void reconnect(libModbusSystematomSPU_async_private* d)
+{
+    d->fd = libModbusSystematomSPU_rtu_open(d->portname.c_str(), d->baudrate, true);
+    if (d->fd >= 0 && watch(d))
+    {
+        close(d->fd);
+        d->fd = -1;
+    }
+    if (d->fd < 0)
+    {
+        libModbusSystematomSPU_report(SPU_ERROR_CONNECT, errno, "libModbusSystematomSPU_async", "reconnect()", d->portname.c_str(), d->slave);
+        reconnectLater(d);
+        return;
+    }
+    libModbusSystematomSPU_report(SPU_INFO_CONNECTED, 0, "libModbusSystematomSPU_async", "reconnect()", d->portname.c_str(), d->slave);
+    d->connected = true;
+    d->backoff = std::chrono::milliseconds(0);
+    d->state = libModbusSystematomSPU_async_private::IDLE;
+    startNext(d);
+}
+
+static void onReadable(libModbusSystematomSPU_async_private* d, uint32_t events)
+{
+    if (d->fd < 0) return;      // Closed earlier in this epoll batch
+    for (;;)
+    {
+        ssize_t n = read(d->fd, d->rx + d->rxLen, sizeof(d->rx) - d->rxLen);
+        // An error other than "nothing more" (EIO once the adapter is gone): the device is gone. A level-triggered
+        // fd left registered would wake the reactor again at once, forever. 0 is no data (VMIN = 0), or the end
+        // of a line that hung up, which EPOLLHUP tells below.
+        if (n < 0 && errno != EAGAIN && errno != EINTR) { lineDown(d, errno); return; }
+        if (n <= 0) break;
+        // Bytes outside a transaction are noise on the line
+        if (d->state == libModbusSystematomSPU_async_private::WAIT_RESPONSE) d->rxLen += n;
+        if (d->rxLen == (int)sizeof(d->rx)) break;
+    }
+    if (events & (EPOLLHUP | EPOLLERR)) { lineDown(d, EIO); return; }
+    if (d->state != libModbusSystematomSPU_async_private::WAIT_RESPONSE) return;
+
+    SPU_ASYNC_REQUEST& request = d->queue.front();
+    const SPU_READ_BLOCK& block = request.plan.blocks[request.block];
+    if (libModbusSystematomSPU_rtu_missing(d->rx, d->rxLen, block.num_registers) > 0) return;
+
+    // Complete frame: no need to wait for the end-of-frame silence
+    disarm(d);
+    if (libModbusSystematomSPU_rtu_response(d->rx, d->rxLen, d->slave, block.num_registers, d->regs + block.start_address) < 0)
+    {
+        libModbusSystematomSPU_report(SPU_ERROR_READ, errno, "libModbusSystematomSPU_async", "read_fields()", d->portname.c_str(), d->slave);
+        complete(d, 1);
+        return;
+    }
+    if (++request.block < request.plan.numBlocks)
+    {
+        d->state = libModbusSystematomSPU_async_private::GAP;
+        arm(d, d->t35);
+    }
+    else complete(d, 0);
+}
+
+static void onTimer(libModbusSystematomSPU_async_private* d)
+{
+    uint64_t expirations;
+    if (read(d->timer, &expirations, sizeof(expirations)) != sizeof(expirations)) return;
+
+    if (d->state == libModbusSystematomSPU_async_private::WAIT_RESPONSE)
+    {
+        libModbusSystematomSPU_report(SPU_ERROR_READ, ETIMEDOUT, "libModbusSystematomSPU_async", "read_fields()", d->portname.c_str(), d->slave);
+        complete(d, 1);
+    }
+    else if (d->state == libModbusSystematomSPU_async_private::GAP)
+    {
+        d->state = libModbusSystematomSPU_async_private::IDLE;
+        if (!d->queue.empty() && d->queue.front().block > 0) sendBlock(d); // Rest of a multi-block plan
+        else startNext(d);
+    }
+    else if (d->state == libModbusSystematomSPU_async_private::RECONNECT) reconnect(d);
+}
+
+static bool inReactor(libModbusSystematomSPU_reactor_private* r) { return std::this_thread::get_id() == r->thread.get_id(); }
+
+// Run command in the reactor thread and wait for it; inline when already there (a completion or a coroutine
+// continuation), where waiting for the reactor would wait for ourselves
+static void runInReactor(libModbusSystematomSPU_reactor_private* r, std::function<void()> command)
+{
+    if (inReactor(r)) { command(); return; }
+    std::promise<void> done;
+    post(r, [&]{ command(); done.set_value(); });
+    done.get_future().wait();
+}
+
+libModbusSystematomSPU_reactor::libModbusSystematomSPU_reactor()
+{
+    this->_p = new libModbusSystematomSPU_reactor_private;
+    this->_p->epfd   = epoll_create1(EPOLL_CLOEXEC);
+    this->_p->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u64 = 0;
+    epoll_ctl(this->_p->epfd, EPOLL_CTL_ADD, this->_p->wakefd, &ev);
+
+    this->_p->thread = std::thread([r = this->_p]
+    {
+        struct epoll_event events[64];
+        std::vector<std::function<void()>> commands;
+        while (r->running.load(std::memory_order_relaxed))
+        {
+            int n = epoll_wait(r->epfd, events, 64, -1);
+            for (int i = 0; i < n; i++)
+            {
+                uint64_t t = events[i].data.u64;
+                if (t == 0)
+                {
+                    uint64_t count;
+                    (void)!read(r->wakefd, &count, sizeof(count));
+                    {
+                        std::lock_guard<std::mutex> lock(r->mtx);
+                        commands.swap(r->commands);
+                    }
+                    for (auto& command : commands) command();
+                    commands.clear();
+                    continue;
+                }
+                auto* d = reinterpret_cast<libModbusSystematomSPU_async_private*>(t & ~uint64_t(1));
+                if (d->removed) continue;
+                if (t & 1) onTimer(d);
+                else       onReadable(d, events[i].events);
+            }
+            for (auto* d : r->retired) delete d;
+            r->retired.clear();
+        }
+        if (r->orphaned)
+        {
+            close(r->wakefd);
+            close(r->epfd);
+            delete r;
+        }
+    });
+}
+
+libModbusSystematomSPU_reactor::~libModbusSystematomSPU_reactor()
+{
+    // The last reference may go away in a completion: the thread cannot join itself, so it cleans up on its way out
+    if (inReactor(this->_p))
+    {
+        this->_p->running = false;
+        this->_p->orphaned = true;
+        this->_p->thread.detach();
+        return;
+    }
+    post(this->_p, [r = this->_p]{ r->running = false; });
+    this->_p->thread.join();
+    for (auto* d : this->_p->retired) delete d;
+    close(this->_p->wakefd);
+    close(this->_p->epfd);
+    delete this->_p;
+}
+
+libModbusSystematomSPU_async::libModbusSystematomSPU_async(std::shared_ptr<libModbusSystematomSPU_reactor> reactor, std::string portname,
+                                                           int slave, int baudrate, std::chrono::milliseconds timeout)
+{
+    this->_p = new libModbusSystematomSPU_async_private;
+    this->_p->reactor  = reactor;
+    this->_p->r        = reactor->_p;
+    this->_p->portname = portname;
+    this->_p->slave    = slave;
+    this->_p->baudrate = baudrate;
+    this->_p->timeout  = timeout;
+    this->_p->t35      = std::chrono::microseconds(baudrate > 19200 ? 1750 : 35000000 / baudrate);
+    this->_p->cost     = libModbusSystematomSPU_cost(baudrate, 10000);
+
+    this->_p->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    this->_p->fd = libModbusSystematomSPU_rtu_open(portname.c_str(), baudrate, true);
+    if (this->_p->fd < 0)
+        libModbusSystematomSPU_report(SPU_ERROR_CONNECT, errno, "libModbusSystematomSPU_async", "libModbusSystematomSPU_async()", portname.c_str());
+    else
+    {
+        libModbusSystematomSPU_report(SPU_INFO_CONNECTED, 0, "libModbusSystematomSPU_async", "libModbusSystematomSPU_async()", portname.c_str());
+        this->_p->connected = true;
+    }
+
+    // Register in the reactor thread; a port that did not open is retried from there
+    runInReactor(reactor->_p, [d = this->_p]
+    {
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = tag(d, true);
+        epoll_ctl(d->r->epfd, EPOLL_CTL_ADD, d->timer, &ev);
+        if (d->fd < 0) reconnectLater(d);
+        else if (watch(d)) lineDown(d, errno);
+    });
+}
+
+libModbusSystematomSPU_async::~libModbusSystematomSPU_async()
+{
+    // Leave the reactor and answer what is still queued with STATE 2. The reactor frees _p after the epoll
+    // batch it is handling, which may still hold events of this device. It must not own the last reference
+    // to itself then, so the reactor pointer leaves _p here.
+    std::shared_ptr<libModbusSystematomSPU_reactor> reactor = std::move(this->_p->reactor);
+    runInReactor(reactor->_p, [d = this->_p]
+    {
+        if (d->fd >= 0)
+        {
+            epoll_ctl(d->r->epfd, EPOLL_CTL_DEL, d->fd, nullptr);
+            close(d->fd);
+            d->fd = -1;
+        }
+        if (d->timer >= 0)
+        {
+            epoll_ctl(d->r->epfd, EPOLL_CTL_DEL, d->timer, nullptr);
+            close(d->timer);
+            d->timer = -1;
+        }
+        d->connected = false;
+        while (!d->queue.empty()) complete(d, 2);
+        d->removed = true;
+        d->r->retired.push_back(d);
+    });
+}
+
+bool        libModbusSystematomSPU_async::isConnected()  { return this->_p->connected; }
+std::string libModbusSystematomSPU_async::get_portname() { return this->_p->portname; }
+
+void libModbusSystematomSPU_async::read_fields(uint32_t fields, std::function<void(const SPU_DATA&)> done)
+{
+    SPU_ASYNC_REQUEST request;
+    request.plan = libModbusSystematomSPU_plan(fields, this->_p->cost);
+    request.done = std::move(done);
+    post(this->_p->reactor->_p, [d = this->_p, request = std::move(request)]() mutable
+    {
+        d->queue.push_back(std::move(request));
+        startNext(d);
+    });
+}
+
+std::future<SPU_DATA> libModbusSystematomSPU_async::read_fields(uint32_t fields)
+{
+    auto promise = std::make_shared<std::promise<SPU_DATA>>();
+    read_fields(fields, [promise](const SPU_DATA& data) { promise->set_value(data); });
+    return promise->get_future();
+}
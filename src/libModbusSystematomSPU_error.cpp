@@ -0,0 +1,155 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024 Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <libModbusSystematomSPU_error.h>
+
+#include <modbus/modbus.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+
+// Entries searched for an identical error before a new one is taken
+constexpr int ERROR_COALESCE_WINDOW = 8;
+
+struct SPU_ERROR_LOG
+{
+    std::mutex mtx;
+    SPU_ERROR entries[SPU_ERROR_LOG_SIZE];
+    std::chrono::system_clock::time_point reported[SPU_ERROR_LOG_SIZE];  // Last time the sink saw entry i
+    uint64_t next = 0;                                                   // Entries ever taken
+
+    std::mutex sinkMtx;
+    std::function<void(const SPU_ERROR&)> sink = libModbusSystematomSPU_stderr_sink;
+    std::chrono::milliseconds interval{1000};
+};
+
+static SPU_ERROR_LOG& errorLog()
+{
+    static SPU_ERROR_LOG log;
+    return log;
+}
+
+const char* libModbusSystematomSPU_error_text(SPU_ERROR_CODE code)
+{
+    switch (code)
+    {
+        case SPU_ERROR_CONNECT:    return "Failed to connect to Modbus device:";
+        case SPU_ERROR_NO_CONTEXT: return "Modbus context does not exist";
+        case SPU_ERROR_READ:       return "Failed to read data";
+        case SPU_ERROR_SEND:       return "Failed to send request";
+        case SPU_ERROR_AUTOTUNE:   return "No baudrate answered";
+        case SPU_ERROR_JOURNAL:    return "Failed to map journal";
+        case SPU_ERROR_REPLAY:     return "Journal is empty or invalid";
+        case SPU_ERROR_SHM:        return "Failed to create shared memory";
+        case SPU_ERROR_REALTIME:   return "Failed to apply a real-time setting";
+        case SPU_ERROR_ARCHIVE:    return "Failed to open, write or decode archive";
+        case SPU_INFO_CONNECTED:   return "Connection successful";
+        case SPU_INFO_AUTOTUNED:   return "Auto-tune done";
+    }
+    return "Unknown error";
+}
+
+void libModbusSystematomSPU_report(SPU_ERROR_CODE code, int err, const char* className, const char* function,
+                                   const char* port, int slave)
+{
+    SPU_ERROR_LOG& log = errorLog();
+    auto now = std::chrono::system_clock::now();
+    SPU_ERROR copy;
+    bool report;
+    {
+        std::lock_guard<std::mutex> lock(log.mtx);
+        SPU_ERROR* entry = nullptr;
+        size_t index = 0;
+        for (uint64_t i = log.next; i > 0 && i + ERROR_COALESCE_WINDOW > log.next; i--)
+        {
+            SPU_ERROR& e = log.entries[(i - 1) % SPU_ERROR_LOG_SIZE];
+            if (e.code == code && e.err == err && e.slave == slave && e.function == function && e.className == className &&
+                std::strncmp(e.port, port, SPU_ERROR_PORT_SIZE - 1) == 0)
+            {
+                entry = &e;
+                index = (i - 1) % SPU_ERROR_LOG_SIZE;
+                break;
+            }
+        }
+        if (entry)
+        {
+            entry->repeat++;
+            entry->last = now;
+        }
+        else
+        {
+            index = log.next++ % SPU_ERROR_LOG_SIZE;
+            entry = &log.entries[index];
+            entry->code   = code;
+            entry->err    = err;
+            entry->slave  = slave;
+            entry->className = className;
+            entry->function  = function;
+            std::strncpy(entry->port, port, SPU_ERROR_PORT_SIZE - 1);
+            entry->port[SPU_ERROR_PORT_SIZE - 1] = '\0';
+            entry->first  = now;
+            entry->last   = now;
+            entry->repeat = 1;
+            log.reported[index] = std::chrono::system_clock::time_point();
+        }
+        report = now - log.reported[index] >= log.interval;
+        if (report)
+        {
+            log.reported[index] = now;
+            copy = *entry;
+        }
+    }
+    if (!report) return;
+
+    std::lock_guard<std::mutex> lock(log.sinkMtx);
+    if (log.sink) log.sink(copy);
+}
+
+size_t libModbusSystematomSPU_errors(SPU_ERROR* out, size_t max)
+{
+    SPU_ERROR_LOG& log = errorLog();
+    std::lock_guard<std::mutex> lock(log.mtx);
+    size_t n = std::min<uint64_t>({max, log.next, (uint64_t)SPU_ERROR_LOG_SIZE});
+    for (size_t i = 0; i < n; i++) out[i] = log.entries[(log.next - n + i) % SPU_ERROR_LOG_SIZE];
+    return n;
+}
+
+void libModbusSystematomSPU_set_error_sink(std::function<void(const SPU_ERROR&)> sink, std::chrono::milliseconds interval)
+{
+    SPU_ERROR_LOG& log = errorLog();
+    {
+        std::lock_guard<std::mutex> lock(log.sinkMtx);
+        log.sink = std::move(sink);
+    }
+    std::lock_guard<std::mutex> lock(log.mtx);
+    log.interval = interval;
+}
+
+void libModbusSystematomSPU_stderr_sink(const SPU_ERROR& error)
+{
+    bool info = error.code >= SPU_INFO_CONNECTED;
+    std::cerr << (info ? "INFO in " : "ERROR in ") << error.className << "::" << error.function << " at " << error.port;
+    if (error.slave >= 0) std::cerr << " (slave " << error.slave << ")";
+    std::cerr << (info ? "\n\tEvent: " : "\n\tError type: ") << libModbusSystematomSPU_error_text(error.code);
+    if (error.err != 0) std::cerr << "\n\tError code: " << modbus_strerror(error.err);
+    if (error.repeat > 1) std::cerr << "\n\tRepeated " << error.repeat << " times";
+    std::cerr << std::endl;
+}
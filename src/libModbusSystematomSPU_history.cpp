@@ -0,0 +1,242 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024 Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <libModbusSystematomSPU_history.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <limits>
+
+// Portable SIMD (GCC vector extensions): SSE/AVX/NEON, whatever the target has
+typedef float  v8f __attribute__((vector_size(32)));
+typedef float  v4f __attribute__((vector_size(16)));
+typedef double v4d __attribute__((vector_size(32)));
+typedef int    v8i __attribute__((vector_size(32)));
+
+// Vectors go through references: passing them by value changes the ABI between AVX and non-AVX builds
+#define LOAD(v, p) std::memcpy(&(v), (p), sizeof(v))
+
+static inline bool any(const v8i& mask)
+{
+    uint64_t words[4];
+    std::memcpy(words, &mask, sizeof(words));
+    return (words[0] | words[1] | words[2] | words[3]) != 0;
+}
+
+// Blocks of timestamps: a new base at least every BLOCK_SAMPLES samples (or when an offset would overflow)
+constexpr uint64_t BLOCK_SAMPLES = 4096;
+constexpr int64_t  MAX_OFFSET_NS = int64_t(std::numeric_limits<uint32_t>::max()) * 1000;
+
+static int columnIndex(SPU_FIELD column) { return std::countr_zero(uint32_t(column)); }        // 0..8
+static int flagIndex  (SPU_FIELD flag)   { return std::countr_zero(uint32_t(flag)) - 9; }      // 0..9
+
+libModbusSystematomSPU_history::libModbusSystematomSPU_history(size_t capacity)
+{
+    capacity = std::bit_ceil(std::max<size_t>(capacity, 64));
+    this->mask = capacity - 1;
+    for (auto& column : this->columns) column.resize(capacity);
+    for (auto& flag : this->flags) flag.resize(capacity / 64);
+    this->offsets.resize(capacity);
+}
+
+bool libModbusSystematomSPU_history::append(const SPU_DATA& data)
+{
+    if (data.STATE != 0) return 1;
+    SPU_RECORD record = libModbusSystematomSPU_pack(data);
+    uint64_t i = this->head;
+    size_t slot = i & this->mask;
+
+    for (int k = 0; k < 9; k++) this->columns[k][slot] = record.fp[k];
+    uint64_t bit = uint64_t(1) << (slot & 63);
+    for (int k = 0; k < 10; k++)
+    {
+        uint64_t& word = this->flags[k][slot >> 6];
+        word = (record.flags >> k & 1) ? word | bit : word & ~bit;
+    }
+
+    int64_t t = std::max(record.time_ns, this->lastNs);
+    if (this->blocks.empty() || i - this->blocks.back().first >= BLOCK_SAMPLES || t - this->blocks.back().base_ns > MAX_OFFSET_NS)
+        this->blocks.push_back({i, t});
+    this->offsets[slot] = uint32_t((t - this->blocks.back().base_ns) / 1000);
+    this->lastNs = t;
+    this->head++;
+
+    // Forget the blocks whose samples were all overwritten
+    while (this->blocks.size() > 1 && this->blocks[1].first <= first()) this->blocks.pop_front();
+    return 0;
+}
+
+uint64_t libModbusSystematomSPU_history::first()    { return this->head > this->mask ? this->head - this->mask - 1 : 0; }
+uint64_t libModbusSystematomSPU_history::end()      { return this->head; }
+size_t   libModbusSystematomSPU_history::size()     { return this->head - first(); }
+size_t   libModbusSystematomSPU_history::capacity() { return this->mask + 1; }
+
+float libModbusSystematomSPU_history::value(SPU_FIELD column, uint64_t i) { return this->columns[columnIndex(column)][i & this->mask]; }
+bool  libModbusSystematomSPU_history::flag (SPU_FIELD flag,   uint64_t i) { return this->flags[flagIndex(flag)][(i & this->mask) >> 6] >> (i & 63) & 1; }
+
+std::chrono::system_clock::time_point libModbusSystematomSPU_history::time(uint64_t i)
+{
+    auto block = std::upper_bound(this->blocks.begin(), this->blocks.end(), i, [](uint64_t i, const BLOCK& b) { return i < b.first; });
+    int64_t ns = (block == this->blocks.begin() ? 0 : std::prev(block)->base_ns) + int64_t(this->offsets[i & this->mask]) * 1000;
+    return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(ns)));
+}
+
+uint64_t libModbusSystematomSPU_history::lower_bound(std::chrono::system_clock::time_point t)
+{
+    uint64_t lo = first(), hi = end();
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (time(mid) < t) lo = mid + 1;
+        else               hi = mid;
+    }
+    return lo;
+}
+
+size_t libModbusSystematomSPU_history::window(uint64_t& begin, uint64_t& end)
+{
+    begin = std::max(begin, first());
+    end   = std::min(end, this->head);
+    return end > begin ? end - begin : 0;
+}
+
+// min/max in float lanes; sum and sum of squares in double lanes, shifted by k against cancellation
+static void statsKernel(const float* p, size_t n, float k, float& mn, float& mx, double& sum, double& sumsq)
+{
+    size_t i = 0;
+    if (n >= 8)
+    {
+        v8f vmn, vmx;
+        LOAD(vmn, p);
+        vmx = vmn;
+        v4d vk = {k, k, k, k};
+        v4d s = {0, 0, 0, 0}, s2 = {0, 0, 0, 0};
+        for (; i + 8 <= n; i += 8)
+        {
+            v8f v;
+            v4f lo4, hi4;
+            LOAD(v, p + i);
+            LOAD(lo4, p + i);
+            LOAD(hi4, p + i + 4);
+            vmn = v < vmn ? v : vmn;
+            vmx = v > vmx ? v : vmx;
+            v4d lo = __builtin_convertvector(lo4, v4d) - vk;
+            v4d hi = __builtin_convertvector(hi4, v4d) - vk;
+            s  += lo + hi;
+            s2 += lo * lo + hi * hi;
+        }
+        for (int l = 0; l < 8; l++) { mn = std::min(mn, vmn[l]); mx = std::max(mx, vmx[l]); }
+        for (int l = 0; l < 4; l++) { sum += s[l]; sumsq += s2[l]; }
+    }
+    for (; i < n; i++)
+    {
+        mn = std::min(mn, p[i]);
+        mx = std::max(mx, p[i]);
+        double d = double(p[i]) - k;
+        sum += d;
+        sumsq += d * d;
+    }
+}
+
+SPU_WINDOW_STATS libModbusSystematomSPU_history::stats(SPU_FIELD column, uint64_t begin, uint64_t end)
+{
+    SPU_WINDOW_STATS stats;
+    size_t n = window(begin, end);
+    if (n == 0) return stats;
+
+    const float* data = this->columns[columnIndex(column)].data();
+    float k = data[begin & this->mask];
+    float mn = k, mx = k;
+    double sum = 0, sumsq = 0;
+    // The window is at most two contiguous runs of the ring
+    size_t slot = begin & this->mask;
+    size_t run = std::min(n, capacity() - slot);
+    statsKernel(data + slot, run, k, mn, mx, sum, sumsq);
+    statsKernel(data, n - run, k, mn, mx, sum, sumsq);
+
+    stats.count    = n;
+    stats.min      = mn;
+    stats.max      = mx;
+    stats.mean     = k + sum / n;
+    stats.variance = std::max(0.0, sumsq / n - (sum / n) * (sum / n));
+    return stats;
+}
+
+// First j in [0, n) with prev(j) below and p[j] at/above threshold (or the opposite), where prev(0) = before
+static size_t crossingKernel(const float* p, size_t n, float before, float threshold, bool rising)
+{
+    if (n == 0) return 0;
+    if (rising ? (before < threshold && p[0] >= threshold) : (before >= threshold && p[0] < threshold)) return 0;
+    size_t j = 1;
+    v8f th = v8f{} + threshold;
+    for (; j + 8 <= n; j += 8)
+    {
+        v8f cur, prev;
+        LOAD(cur, p + j);
+        LOAD(prev, p + j - 1);
+        v8i hit = rising ? (prev < th) & (cur >= th) : (prev >= th) & (cur < th);
+        if (any(hit))
+            for (int l = 0; l < 8; l++) if (hit[l]) return j + l;
+    }
+    for (; j < n; j++)
+        if (rising ? (p[j-1] < threshold && p[j] >= threshold) : (p[j-1] >= threshold && p[j] < threshold)) return j;
+    return n;
+}
+
+uint64_t libModbusSystematomSPU_history::find_crossing(SPU_FIELD column, float threshold, uint64_t begin, uint64_t end, bool rising)
+{
+    uint64_t requestedEnd = end;
+    if (window(begin, end) < 2) return requestedEnd;
+
+    const float* data = this->columns[columnIndex(column)].data();
+    uint64_t i = begin + 1;
+    while (i < end)
+    {
+        size_t slot = i & this->mask;
+        size_t run = std::min<uint64_t>(end - i, capacity() - slot);
+        size_t j = crossingKernel(data + slot, run, data[(i - 1) & this->mask], threshold, rising);
+        if (j < run) return i + j;
+        i += run;
+    }
+    return requestedEnd;
+}
+
+size_t libModbusSystematomSPU_history::flag_edges(SPU_FIELD flag, uint64_t begin, uint64_t end, uint64_t* out, size_t max, bool rising)
+{
+    if (window(begin, end) < 2) return 0;
+    const std::vector<uint64_t>& bits = this->flags[flagIndex(flag)];
+
+    // 64 samples per step: bit j of a word is sample word*64 + j, its predecessor bit j-1 (or bit 63 of the word before)
+    size_t found = 0;
+    for (uint64_t word = (begin + 1) & ~uint64_t(63); word < end && found < max; word += 64)
+    {
+        uint64_t x    = bits[(word & this->mask) >> 6];
+        uint64_t prev = (x << 1) | (bits[((word - 64) & this->mask) >> 6] >> 63);
+        uint64_t edges = rising ? x & ~prev : ~x & prev;
+        if (word < begin + 1)  edges &= ~uint64_t(0) << (begin + 1 - word);
+        if (end - word < 64)   edges &= (uint64_t(1) << (end - word)) - 1;
+        while (edges && found < max)
+        {
+            out[found++] = word + std::countr_zero(edges);
+            edges &= edges - 1;
+        }
+    }
+    return found;
+}
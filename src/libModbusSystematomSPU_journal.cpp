@@ -0,0 +1,242 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024 Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <libModbusSystematomSPU_journal.h>
+#include <libModbusSystematomSPU_error.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char     JOURNAL_MAGIC[8]   = {'S','P','U','J','R','N','L','1'};
+static const uint32_t JOURNAL_VERSION    = 1;
+static const size_t   JOURNAL_DATA       = 4096;            // Records start after one page of header
+static const uint64_t JOURNAL_GROW       = 16384;           // Records added each time the file grows (1 MiB)
+
+// Commit marker: checksum of the record (never 0, the value of a record not written yet)
+static uint32_t journalMarker(const SPU_RECORD& record)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&record);
+    uint32_t h = 2166136261u; // FNV-1a
+    for (size_t i = 0; i < offsetof(SPU_RECORD, commit); i++) h = (h ^ bytes[i]) * 16777619u;
+    return h ? h : 1;
+}
+
+static bool journalCommitted(const SPU_RECORD& record)
+{
+    uint32_t marker = std::atomic_ref<uint32_t>(const_cast<uint32_t&>(record.commit)).load(std::memory_order_acquire);
+    return marker != 0 && marker == journalMarker(record);
+}
+
+// Number of committed records, starting the scan from the header hint
+static uint64_t journalScan(uint8_t* map, uint64_t capacity)
+{
+    auto* header  = reinterpret_cast<SPU_JOURNAL_HEADER*>(map);
+    auto* records = reinterpret_cast<SPU_RECORD*>(map + JOURNAL_DATA);
+    uint64_t n = std::min(header->count, capacity);
+    while (n > 0 && !journalCommitted(records[n - 1])) n--;
+    while (n < capacity && journalCommitted(records[n])) n++;
+    return n;
+}
+
+struct libModbusSystematomSPU_journal_private {
+    std::string path;
+    int fd = -1;
+    uint8_t* map = nullptr;
+    uint64_t capacity = 0;  // Records that fit in the mapped file
+    uint64_t count = 0;
+};
+
+libModbusSystematomSPU_journal::libModbusSystematomSPU_journal(std::string path)
+{
+    this->_p = new libModbusSystematomSPU_journal_private;
+    this->_p->path = path;
+    this->_p->fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+
+    struct stat st;
+    if (this->_p->fd < 0 || fstat(this->_p->fd, &st) != 0)
+    {
+        libModbusSystematomSPU_report(SPU_ERROR_JOURNAL, errno, "libModbusSystematomSPU_journal", "libModbusSystematomSPU_journal()", path.c_str());
+        return;
+    }
+
+    bool created = st.st_size < (off_t)JOURNAL_DATA;
+    uint64_t capacity = created ? 0 : (st.st_size - JOURNAL_DATA) / sizeof(SPU_RECORD);
+    if (resize(capacity > 0 ? capacity : JOURNAL_GROW)) return;
+
+    auto* header = reinterpret_cast<SPU_JOURNAL_HEADER*>(this->_p->map);
+    if (created)
+    {
+        std::memcpy(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+        header->version    = JOURNAL_VERSION;
+        header->recordSize = sizeof(SPU_RECORD);
+        header->count      = 0;
+        header->created_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+    else if (std::memcmp(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 || header->recordSize != sizeof(SPU_RECORD))
+    {
+        errno = EINVAL;
+        libModbusSystematomSPU_report(SPU_ERROR_JOURNAL, errno, "libModbusSystematomSPU_journal", "libModbusSystematomSPU_journal()", path.c_str());
+        munmap(this->_p->map, JOURNAL_DATA + this->_p->capacity * sizeof(SPU_RECORD));
+        this->_p->map = nullptr;
+        return;
+    }
+    this->_p->count = journalScan(this->_p->map, this->_p->capacity);
+}
+
+libModbusSystematomSPU_journal::~libModbusSystematomSPU_journal()
+{
+    if (this->_p->map)
+    {
+        flush();
+        munmap(this->_p->map, JOURNAL_DATA + this->_p->capacity * sizeof(SPU_RECORD));
+    }
+    if (this->_p->fd >= 0) close(this->_p->fd);
+    delete this->_p;
+}
+
+// Size the file for capacity records (new ones are zero filled, so not committed) and map it again
+bool libModbusSystematomSPU_journal::resize(uint64_t capacity)
+{
+    uint64_t oldSize  = JOURNAL_DATA + this->_p->capacity * sizeof(SPU_RECORD);
+    uint64_t size     = JOURNAL_DATA + capacity * sizeof(SPU_RECORD);
+    if (this->_p->map) munmap(this->_p->map, oldSize);
+    this->_p->map = nullptr;
+
+    void* map = MAP_FAILED;
+    if (ftruncate(this->_p->fd, size) == 0)
+        map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, this->_p->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        libModbusSystematomSPU_report(SPU_ERROR_JOURNAL, errno, "libModbusSystematomSPU_journal", "resize()", this->_p->path.c_str());
+        return 1;
+    }
+    this->_p->map = static_cast<uint8_t*>(map);
+    this->_p->capacity = capacity;
+    return 0;
+}
+
+bool        libModbusSystematomSPU_journal::isOpen()   { return this->_p->map != nullptr; }
+std::string libModbusSystematomSPU_journal::get_path() { return this->_p->path; }
+uint64_t    libModbusSystematomSPU_journal::size()     { return this->_p->count; }
+
+bool libModbusSystematomSPU_journal::append(const SPU_DATA& data)
+{
+    if (!this->_p->map) return 1;
+    if (this->_p->count == this->_p->capacity && resize(this->_p->capacity + JOURNAL_GROW)) return 1;
+
+    SPU_RECORD* records = reinterpret_cast<SPU_RECORD*>(this->_p->map + JOURNAL_DATA);
+    SPU_RECORD record = libModbusSystematomSPU_pack(data);
+    // seek() searches by time: a wall clock stepped back (NTP) must not unsort the journal
+    if (this->_p->count > 0) record.time_ns = std::max(record.time_ns, records[this->_p->count - 1].time_ns);
+    uint32_t marker = journalMarker(record);
+    record.commit = 0;
+
+    // Payload first, marker last: a reader (or a restart after a crash) never sees half a record
+    SPU_RECORD& slot = records[this->_p->count];
+    std::memcpy(&slot, &record, sizeof(SPU_RECORD));
+    std::atomic_ref<uint32_t>(slot.commit).store(marker, std::memory_order_release);
+    this->_p->count++;
+    return 0;
+}
+
+void libModbusSystematomSPU_journal::flush()
+{
+    if (!this->_p->map) return;
+    reinterpret_cast<SPU_JOURNAL_HEADER*>(this->_p->map)->count = this->_p->count;
+    msync(this->_p->map, JOURNAL_DATA + this->_p->capacity * sizeof(SPU_RECORD), MS_ASYNC);
+}
+
+struct libModbusSystematomSPU_journal_reader_private {
+    std::string path;
+    int fd = -1;
+    uint8_t* map = nullptr;
+    uint64_t mapSize = 0;
+    uint64_t count = 0;
+};
+
+libModbusSystematomSPU_journal_reader::libModbusSystematomSPU_journal_reader(std::string path)
+{
+    this->_p = new libModbusSystematomSPU_journal_reader_private;
+    this->_p->path = path;
+    this->_p->fd = open(path.c_str(), O_RDONLY);
+    refresh();
+}
+
+libModbusSystematomSPU_journal_reader::~libModbusSystematomSPU_journal_reader()
+{
+    if (this->_p->map) munmap(this->_p->map, this->_p->mapSize);
+    if (this->_p->fd >= 0) close(this->_p->fd);
+    delete this->_p;
+}
+
+void libModbusSystematomSPU_journal_reader::refresh()
+{
+    struct stat st;
+    if (this->_p->fd < 0 || fstat(this->_p->fd, &st) != 0 || st.st_size < (off_t)JOURNAL_DATA)
+    {
+        libModbusSystematomSPU_report(SPU_ERROR_JOURNAL, errno, "libModbusSystematomSPU_journal_reader", "refresh()", this->_p->path.c_str());
+        return;
+    }
+    if ((uint64_t)st.st_size != this->_p->mapSize)
+    {
+        if (this->_p->map) munmap(this->_p->map, this->_p->mapSize);
+        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, this->_p->fd, 0);
+        this->_p->map = map == MAP_FAILED ? nullptr : static_cast<uint8_t*>(map);
+        this->_p->mapSize = this->_p->map ? st.st_size : 0;
+    }
+    auto* header = reinterpret_cast<SPU_JOURNAL_HEADER*>(this->_p->map);
+    if (!header || std::memcmp(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0 || header->recordSize != sizeof(SPU_RECORD))
+    {
+        errno = EINVAL;
+        libModbusSystematomSPU_report(SPU_ERROR_JOURNAL, errno, "libModbusSystematomSPU_journal_reader", "refresh()", this->_p->path.c_str());
+        this->_p->count = 0;
+        return;
+    }
+    this->_p->count = journalScan(this->_p->map, (this->_p->mapSize - JOURNAL_DATA) / sizeof(SPU_RECORD));
+}
+
+bool     libModbusSystematomSPU_journal_reader::isOpen() { return this->_p->map != nullptr; }
+uint64_t libModbusSystematomSPU_journal_reader::size()   { return this->_p->count; }
+
+const SPU_RECORD& libModbusSystematomSPU_journal_reader::record(uint64_t index)
+{
+    return reinterpret_cast<const SPU_RECORD*>(this->_p->map + JOURNAL_DATA)[index];
+}
+
+SPU_DATA libModbusSystematomSPU_journal_reader::at(uint64_t index) { return libModbusSystematomSPU_unpack(record(index)); }
+
+uint64_t libModbusSystematomSPU_journal_reader::seek(std::chrono::system_clock::time_point time)
+{
+    // Records are in acquisition order, so the file itself is the time index
+    int64_t t = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    uint64_t lo = 0, hi = this->_p->count;
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (record(mid).time_ns < t) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
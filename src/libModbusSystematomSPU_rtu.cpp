@@ -0,0 +1,203 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024 Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <libModbusSystematomSPU_rtu.h>
+
+#include <modbus/modbus.h>
+
+#include <cerrno>
+#include <ctime>
+
+#include <poll.h>
+
+#include <fcntl.h>
+#include <linux/serial.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+static speed_t rtuSpeed(int baudrate)
+{
+    switch (baudrate)
+    {
+        case 1200:    return B1200;
+        case 2400:    return B2400;
+        case 4800:    return B4800;
+        case 9600:    return B9600;
+        case 19200:   return B19200;
+        case 38400:   return B38400;
+        case 57600:   return B57600;
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+        case 460800:  return B460800;
+        case 500000:  return B500000;
+        case 921600:  return B921600;
+        case 1000000: return B1000000;
+        default:      return B0;
+    }
+}
+
+int libModbusSystematomSPU_rtu_open(const char* portname, int baudrate, bool nonblocking)
+{
+    speed_t speed = rtuSpeed(baudrate);
+    if (speed == B0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = open(portname, O_RDWR | O_NOCTTY | O_CLOEXEC | (nonblocking ? O_NONBLOCK : 0));
+    if (fd < 0) return -1;
+
+    struct termios tios;
+    if (tcgetattr(fd, &tios) != 0)
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    cfmakeraw(&tios);
+    cfsetispeed(&tios, speed);
+    cfsetospeed(&tios, speed);
+    tios.c_cflag |= CREAD | CLOCAL;
+    tios.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+    tios.c_cc[VMIN]  = 0;
+    tios.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &tios) != 0)
+    {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+// CRC of every byte value, built at compile time: one lookup per byte instead of eight shifts
+struct SPU_CRC_TABLE
+{
+    uint16_t value[256];
+    constexpr SPU_CRC_TABLE() : value()
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            uint16_t crc = i;
+            for (int bit = 0; bit < 8; bit++) crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+            value[i] = crc;
+        }
+    }
+};
+static constexpr SPU_CRC_TABLE crcTable;
+static_assert(crcTable.value[1] == 0xC0C1 && crcTable.value[255] == 0x4040, "CRC16 table");
+
+int libModbusSystematomSPU_rtu_low_latency(int fd)
+{
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) != 0) return -1;
+    if (serial.flags & ASYNC_LOW_LATENCY) return 0;
+    serial.flags |= ASYNC_LOW_LATENCY;
+    return ioctl(fd, TIOCSSERIAL, &serial);
+}
+
+uint16_t libModbusSystematomSPU_crc16(const uint8_t* data, size_t len)
+{
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < len; i++) crc = (crc >> 8) ^ crcTable.value[(crc ^ data[i]) & 0xFF];
+    return crc;
+}
+
+int libModbusSystematomSPU_rtu_request(uint8_t* frame, int slave, int start_address, int num_registers)
+{
+    frame[0] = slave;
+    frame[1] = 0x03;
+    frame[2] = start_address >> 8;
+    frame[3] = start_address & 0xFF;
+    frame[4] = num_registers >> 8;
+    frame[5] = num_registers & 0xFF;
+    uint16_t crc = libModbusSystematomSPU_crc16(frame, 6);
+    frame[6] = crc & 0xFF;
+    frame[7] = crc >> 8;
+    return SPU_RTU_REQUEST_SIZE;
+}
+
+int libModbusSystematomSPU_rtu_missing(const uint8_t* frame, int len, int num_registers)
+{
+    int size = (len >= 2 && (frame[1] & 0x80)) ? SPU_RTU_EXCEPTION_SIZE : libModbusSystematomSPU_rtu_response_size(num_registers);
+    return len >= size ? 0 : size - len;
+}
+
+int libModbusSystematomSPU_rtu_response(const uint8_t* frame, int len, int slave, int num_registers, uint16_t* dest)
+{
+    if (len < SPU_RTU_EXCEPTION_SIZE || libModbusSystematomSPU_crc16(frame, len - 2) != (frame[len-2] | frame[len-1] << 8))
+    {
+        errno = EMBBADCRC;
+        return -1;
+    }
+    if (frame[0] != slave)
+    {
+        errno = EMBBADSLAVE;
+        return -1;
+    }
+    if (frame[1] == (0x03 | 0x80))
+    {
+        errno = MODBUS_ENOBASE + frame[2];
+        return -1;
+    }
+    if (frame[1] != 0x03 || frame[2] != 2 * num_registers || len != libModbusSystematomSPU_rtu_response_size(num_registers))
+    {
+        errno = EMBBADDATA;
+        return -1;
+    }
+    for (int i = 0; i < num_registers; i++) dest[i] = frame[3 + 2*i] << 8 | frame[4 + 2*i];
+    return num_registers;
+}
+
+int libModbusSystematomSPU_rtu_transact(int fd, const uint8_t* request, int num_registers, uint16_t* dest,
+                                        std::chrono::microseconds responseTimeout, std::chrono::microseconds byteTimeout)
+{
+    if (write(fd, request, SPU_RTU_REQUEST_SIZE) != SPU_RTU_REQUEST_SIZE) return -1;
+
+    // Read exactly what is still missing: the frame ends with its last byte, not after t3.5 of silence
+    uint8_t frame[SPU_RTU_MAX_FRAME_SIZE];
+    int len = 0;
+    auto deadline = std::chrono::steady_clock::now() + responseTimeout;
+    for (int missing; (missing = libModbusSystematomSPU_rtu_missing(frame, len, num_registers)) > 0; )
+    {
+        ssize_t n = read(fd, frame + len, missing);
+        if (n > 0)
+        {
+            len += n;
+            deadline = std::chrono::steady_clock::now() + byteTimeout;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+
+        auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        struct pollfd pfd = {fd, POLLIN, 0};
+        struct timespec ts = {left / 1000000000, left % 1000000000};
+        if (ppoll(&pfd, 1, &ts, nullptr) < 0 && errno != EINTR) return -1;
+    }
+    return libModbusSystematomSPU_rtu_response(frame, len, request[0], num_registers, dest);
+}
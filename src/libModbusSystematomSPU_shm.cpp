@@ -0,0 +1,94 @@
+/*
+libModbusSystematomSPU is a library to communicate with the SystemAtom SPU
+using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024 Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <libModbusSystematomSPU_shm.h>
+#include <libModbusSystematomSPU_error.h>
+
+#include <bit>
+#include <new>
+
+struct libModbusSystematomSPU_shm_private {
+    std::string name;
+    SPU_SHM_SEGMENT* segment = nullptr;
+    SPU_SHM_SLOT* ring = nullptr;
+    uint64_t mask = 0;
+    size_t size = 0;
+};
+
+libModbusSystematomSPU_shm::libModbusSystematomSPU_shm(std::string name, size_t capacity)
+{
+    this->_p = new libModbusSystematomSPU_shm_private;
+    this->_p->name = name;
+    capacity = std::bit_ceil(std::max<size_t>(capacity, 1));
+    this->_p->size = libModbusSystematomSPU_shm_size(capacity);
+
+    // A fresh segment every time: readers of a previous one keep their (now orphaned) mapping
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    void* map = MAP_FAILED;
+    if (fd >= 0 && ftruncate(fd, this->_p->size) == 0)
+        map = mmap(nullptr, this->_p->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    if (fd >= 0) close(fd);
+    if (map == MAP_FAILED)
+    {
+        libModbusSystematomSPU_report(SPU_ERROR_SHM, err, "libModbusSystematomSPU_shm", "libModbusSystematomSPU_shm()", name.c_str());
+        if (fd >= 0) shm_unlink(name.c_str());
+        return;
+    }
+
+    // ftruncate() zero filled it: the seqlocks start empty (a slot is valid only below head)
+    auto* segment = new (map) SPU_SHM_SEGMENT;
+    this->_p->ring = reinterpret_cast<SPU_SHM_SLOT*>(static_cast<uint8_t*>(map) + SPU_SHM_RING_OFFSET);
+    for (size_t i = 0; i < capacity; i++) new (&this->_p->ring[i]) SPU_SHM_SLOT;
+    segment->head.store(0, std::memory_order_relaxed);
+    segment->header.version    = SPU_SHM_VERSION;
+    segment->header.recordSize = sizeof(SPU_RECORD);
+    segment->header.capacity   = capacity;
+    segment->header.created_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    segment->header.writerPid  = getpid();
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(segment->header.magic, SPU_SHM_MAGIC, sizeof(SPU_SHM_MAGIC));
+    this->_p->segment = segment;
+    this->_p->mask = capacity - 1;
+}
+
+libModbusSystematomSPU_shm::~libModbusSystematomSPU_shm()
+{
+    if (this->_p->segment)
+    {
+        munmap(this->_p->segment, this->_p->size);
+        shm_unlink(this->_p->name.c_str());
+    }
+    delete this->_p;
+}
+
+bool        libModbusSystematomSPU_shm::isOpen()   { return this->_p->segment != nullptr; }
+std::string libModbusSystematomSPU_shm::get_name() { return this->_p->name; }
+
+void libModbusSystematomSPU_shm::publish(const SPU_DATA& data)
+{
+    if (!this->_p->segment) return;
+    SPU_SHM_ENTRY entry;
+    entry.record = libModbusSystematomSPU_pack(data);
+    entry.index  = this->_p->segment->head.load(std::memory_order_relaxed);
+    this->_p->segment->latest.store(entry.record);
+    this->_p->ring[entry.index & this->_p->mask].store(entry);
+    this->_p->segment->head.store(entry.index + 1, std::memory_order_release);
+}
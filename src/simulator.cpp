@@ -0,0 +1,165 @@
+/*
+This is a simulator of the SystemAtom SPU for libModbusSystematomSPU, a library
+to communicate with the SystemAtom SPU using MODBUS-RTU (RS-485) on a GNU
+operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "spuSimulator.h"
+
+#include <csignal>
+#include <thread>
+
+static std::atomic<bool> running{true};
+
+static const char* FIELD_NAMES[SPU_FIELD_COUNT] = {
+    "N_DATA_FP", "T_DATA_FP", "F1_DATA_FP", "F2_DATA_FP", "F3_DATA_FP",
+    "EMR_N_THRESHOLD", "WRN_N_THRESHOLD", "EMR_T_THRESHOLD", "WRN_T_THRESHOLD",
+    "EMR_N", "WRN_N", "EMR_T", "WRN_T", "R1", "R2", "R3", "RDY", "TEST", "XXXX"};
+
+static void usage(const char* name)
+{
+    std::cerr << "Usage: " << name << " [options]\n"
+              << "  --link <path>             symlink that always points to the simulated serial port\n"
+              << "  --tcp <port>              serve Modbus TCP on 127.0.0.1:<port> instead of a serial port\n"
+              << "  --slave <id>              slave ID to answer (repeat for several SPUs, default 1)\n"
+              << "  --baud <rate>             pace the answers as a line at <rate> baud (0 = no pacing, default 57600)\n"
+              << "  --delay <us>              response delay of the SPU\n"
+              << "  --jitter <us>             uniform extra delay in [0, us]\n"
+              << "  --drop <p>                probability of not answering a request\n"
+              << "  --crc-error <p>           probability of answering with a wrong CRC\n"
+              << "  --disconnect <ms>:<ms>    hang up the line every <ms> for <ms>\n"
+              << "  --wave <FIELD>=<shape>:<offset>:<amplitude>:<period_s>\n"
+              << "                            shape is const, sine, ramp, square or noise\n"
+              << "  --seed <n>                seed of the fault and noise generator\n"
+              << "  --stats <s>               print the statistics every <s> seconds\n";
+}
+
+static bool parseWave(std::string spec, SPU_SIM_CONFIG& config)
+{
+    size_t eq = spec.find('=');
+    if (eq == std::string::npos) return false;
+    std::string field = spec.substr(0, eq);
+    int k = 0;
+    while (k < SPU_FIELD_COUNT && field != FIELD_NAMES[k]) k++;
+    if (k == SPU_FIELD_COUNT) return false;
+
+    char shape[16] = {};
+    SPU_SIM_WAVE w;
+    if (std::sscanf(spec.c_str() + eq + 1, "%15[a-z]:%lf:%lf:%lf", shape, &w.offset, &w.amplitude, &w.period) < 2) return false;
+    std::string s = shape;
+    if      (s == "const")  w.shape = SPU_SIM_WAVE::CONST;
+    else if (s == "sine")   w.shape = SPU_SIM_WAVE::SINE;
+    else if (s == "ramp")   w.shape = SPU_SIM_WAVE::RAMP;
+    else if (s == "square") w.shape = SPU_SIM_WAVE::SQUARE;
+    else if (s == "noise")  w.shape = SPU_SIM_WAVE::NOISE;
+    else return false;
+    config.waves[k] = w;
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    libModbusSystematomSPU_license();
+
+    SPU_SIM_CONFIG config;
+    // A reactor at steady power with slowly varying temperature, thresholds and the ready flag
+    config.waves[0]  = {SPU_SIM_WAVE::SINE,   100, 10, 10};
+    config.waves[1]  = {SPU_SIM_WAVE::SINE,    50,  5, 60};
+    config.waves[2]  = {SPU_SIM_WAVE::RAMP,     0, 10,  5};
+    config.waves[3]  = {SPU_SIM_WAVE::RAMP,    10, 10,  5};
+    config.waves[4]  = {SPU_SIM_WAVE::RAMP,    20, 10,  5};
+    config.waves[5]  = {SPU_SIM_WAVE::CONST,  120,  0,  1};
+    config.waves[6]  = {SPU_SIM_WAVE::CONST,  108,  0,  1};
+    config.waves[7]  = {SPU_SIM_WAVE::CONST,   70,  0,  1};
+    config.waves[8]  = {SPU_SIM_WAVE::CONST,   60,  0,  1};
+    config.waves[10] = {SPU_SIM_WAVE::SQUARE,   0,  1, 20};
+    config.waves[16] = {SPU_SIM_WAVE::CONST,    1,  0,  1};
+
+    std::string link;
+    int tcpPort = 0;
+    int statsEvery = 0;
+    bool slavesGiven = false;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string opt = argv[i];
+        if (i + 1 >= argc) { usage(argv[0]); return 1; }
+        std::string val = argv[++i];
+        try
+        {
+            if      (opt == "--link")      link = val;
+            else if (opt == "--tcp")       tcpPort = std::stoi(val);
+            else if (opt == "--slave")     { if (!slavesGiven) config.slaves.clear(); slavesGiven = true; config.slaves.push_back(std::stoi(val, nullptr, 0)); }
+            else if (opt == "--baud")      config.baudrate = std::stoi(val);
+            else if (opt == "--delay")     config.responseDelay = std::chrono::microseconds(std::stol(val));
+            else if (opt == "--jitter")    config.delayJitter = std::chrono::microseconds(std::stol(val));
+            else if (opt == "--drop")      config.dropRate = std::stod(val);
+            else if (opt == "--crc-error") config.crcErrorRate = std::stod(val);
+            else if (opt == "--seed")      config.seed = std::stoul(val);
+            else if (opt == "--stats")     statsEvery = std::stoi(val);
+            else if (opt == "--disconnect")
+            {
+                size_t colon = val.find(':');
+                config.disconnectEvery = std::chrono::milliseconds(std::stol(val));
+                if (colon != std::string::npos) config.disconnectFor = std::chrono::milliseconds(std::stol(val.substr(colon + 1)));
+            }
+            else if (opt == "--wave")
+            {
+                if (!parseWave(val, config)) { std::cerr << "Invalid wave: " << val << std::endl; return 1; }
+            }
+            else { usage(argv[0]); return 1; }
+        }
+        catch (std::exception&) { usage(argv[0]); return 1; }
+    }
+
+    std::signal(SIGINT,  [](int){ running = false; });
+    std::signal(SIGTERM, [](int){ running = false; });
+
+    spuSimulator sim(config);
+    std::thread server;
+    if (tcpPort > 0)
+    {
+        std::cout << "Simulated SPU at: tcp://127.0.0.1:" << tcpPort << std::endl;
+        server = std::thread([&]{ sim.runTcp(tcpPort, running); });
+    }
+    else
+    {
+        std::string name = sim.openPty(link);
+        if (name.empty()) { std::cerr << "Failed to create a pseudo-terminal" << std::endl; return 2; }
+        std::cout << "Simulated SPU at: " << (link.empty() ? name : link) << std::endl;
+        server = std::thread([&]{ sim.runRtu(running); });
+    }
+
+    auto printStats = [&]{
+        std::cout << "requests=" << sim.stats.requests << " answered=" << sim.stats.answered
+                  << " exceptions=" << sim.stats.exceptions << " dropped=" << sim.stats.dropped
+                  << " crc_errors=" << sim.stats.crcErrors << " bad_requests=" << sim.stats.badRequests
+                  << " disconnects=" << sim.stats.disconnects << std::endl;
+    };
+    auto next = std::chrono::steady_clock::now() + std::chrono::seconds(statsEvery);
+    while (running)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (statsEvery > 0 && std::chrono::steady_clock::now() >= next)
+        {
+            printStats();
+            next += std::chrono::seconds(statsEvery);
+        }
+    }
+    server.join();
+    printStats();
+    return 0;
+}
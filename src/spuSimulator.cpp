@@ -0,0 +1,313 @@
+/*
+This is a simulator of the SystemAtom SPU for libModbusSystematomSPU, a library
+to communicate with the SystemAtom SPU using MODBUS-RTU (RS-485) on a GNU
+operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "spuSimulator.h"
+
+#include <libModbusSystematomSPU_rtu.h>
+
+#include <modbus/modbus.h>
+#include <modbus/modbus-rtu.h>
+#include <modbus/modbus-tcp.h>
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/select.h>
+#include <termios.h>
+#include <unistd.h>
+
+static float SPU_DATA::* const SIM_FP[9] = {
+    &SPU_DATA::N_DATA_FP, &SPU_DATA::T_DATA_FP, &SPU_DATA::F1_DATA_FP, &SPU_DATA::F2_DATA_FP, &SPU_DATA::F3_DATA_FP,
+    &SPU_DATA::EMR_N_THRESHOLD, &SPU_DATA::WRN_N_THRESHOLD, &SPU_DATA::EMR_T_THRESHOLD, &SPU_DATA::WRN_T_THRESHOLD};
+static int SPU_DATA::* const SIM_I16[10] = {
+    &SPU_DATA::EMR_N, &SPU_DATA::WRN_N, &SPU_DATA::EMR_T, &SPU_DATA::WRN_T, &SPU_DATA::R1,
+    &SPU_DATA::R2, &SPU_DATA::R3, &SPU_DATA::RDY, &SPU_DATA::TEST, &SPU_DATA::XXXX};
+
+spuSimulator::spuSimulator(SPU_SIM_CONFIG config) : config(config), rng(config.seed)
+{
+    this->t0 = std::chrono::steady_clock::now();
+}
+
+spuSimulator::~spuSimulator()
+{
+    if (this->master >= 0) close(this->master);
+    if (!this->link.empty()) unlink(this->link.c_str());
+}
+
+bool spuSimulator::chance(double p)
+{
+    return p > 0 && std::uniform_real_distribution<double>(0, 1)(this->rng) < p;
+}
+
+std::chrono::microseconds spuSimulator::delay()
+{
+    auto jitter = this->config.delayJitter.count();
+    if (jitter <= 0) return this->config.responseDelay;
+    return this->config.responseDelay + std::chrono::microseconds(std::uniform_int_distribution<long>(0, jitter)(this->rng));
+}
+
+void spuSimulator::image(int slave, double t, uint16_t* regs)
+{
+    // Every extra slave sees the same waveforms a little later
+    auto index = std::find(this->config.slaves.begin(), this->config.slaves.end(), slave) - this->config.slaves.begin();
+    t += 0.1 * index;
+
+    SPU_DATA data;
+    for (int k = 0; k < SPU_FIELD_COUNT; k++)
+    {
+        const SPU_SIM_WAVE& w = this->config.waves[k];
+        double phase = w.period > 0 ? t / w.period - std::floor(t / w.period) : 0;
+        double v = w.offset;
+        switch (w.shape)
+        {
+            case SPU_SIM_WAVE::CONST:  break;
+            case SPU_SIM_WAVE::SINE:   v += w.amplitude * std::sin(2 * M_PI * phase); break;
+            case SPU_SIM_WAVE::RAMP:   v += w.amplitude * phase; break;
+            case SPU_SIM_WAVE::SQUARE: v += phase < 0.5 ? w.amplitude : 0; break;
+            case SPU_SIM_WAVE::NOISE:  v += w.amplitude * std::uniform_real_distribution<double>(-1, 1)(this->rng); break;
+        }
+        if (k < 9) data.*SIM_FP[k] = static_cast<float>(v);
+        else       data.*SIM_I16[k - 9] = static_cast<int>(std::lround(v));
+    }
+    libModbusSystematomSPU_encode(data, regs);
+}
+
+std::string spuSimulator::openPty(std::string link)
+{
+    this->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (this->master < 0 || grantpt(this->master) != 0 || unlockpt(this->master) != 0) return "";
+    std::string name = ptsname(this->master);
+
+    // Raw mode on the other side, so our answers are never echoed back before the library opens it
+    int slave = open(name.c_str(), O_RDWR | O_NOCTTY);
+    if (slave >= 0)
+    {
+        struct termios tios;
+        tcgetattr(slave, &tios);
+        cfmakeraw(&tios);
+        tcsetattr(slave, TCSANOW, &tios);
+        close(slave);
+    }
+
+    if (!link.empty())
+    {
+        this->link = link;
+        std::string tmp = link + ".tmp";
+        unlink(tmp.c_str());
+        if (symlink(name.c_str(), tmp.c_str()) == 0) rename(tmp.c_str(), link.c_str());
+    }
+    return name;
+}
+
+int spuSimulator::answer(const uint8_t* req, int len, uint8_t* rsp, double t)
+{
+    if (len < 4 || libModbusSystematomSPU_crc16(req, len - 2) != (req[len-2] | req[len-1] << 8))
+    {
+        this->stats.badRequests++;
+        return 0;
+    }
+    int slave = req[0];
+    if (std::find(this->config.slaves.begin(), this->config.slaves.end(), slave) == this->config.slaves.end()) return 0;
+    this->stats.requests++;
+
+    int n = 0;
+    int function = req[1];
+    rsp[n++] = slave;
+    if ((function == 0x03 || function == 0x04) && len == 8)
+    {
+        int address   = req[2] << 8 | req[3];
+        int registers = req[4] << 8 | req[5];
+        if (registers < 1 || registers > SPU_MAX_READ_REGISTERS)
+        {
+            rsp[n++] = function | 0x80;
+            rsp[n++] = 0x03; // Illegal data value
+        }
+        else if (address + registers > SPU_REGISTER_IMAGE_SIZE)
+        {
+            rsp[n++] = function | 0x80;
+            rsp[n++] = 0x02; // Illegal data address
+        }
+        else
+        {
+            uint16_t regs[SPU_REGISTER_IMAGE_SIZE] = {};
+            image(slave, t, regs);
+            rsp[n++] = function;
+            rsp[n++] = 2 * registers;
+            for (int i = 0; i < registers; i++)
+            {
+                rsp[n++] = regs[address + i] >> 8;
+                rsp[n++] = regs[address + i] & 0xFF;
+            }
+        }
+    }
+    else
+    {
+        rsp[n++] = function | 0x80;
+        rsp[n++] = 0x01; // Illegal function
+    }
+    if (rsp[1] & 0x80) this->stats.exceptions++;
+
+    uint16_t crc = libModbusSystematomSPU_crc16(rsp, n);
+    rsp[n++] = crc & 0xFF;
+    rsp[n++] = crc >> 8;
+    return n;
+}
+
+void spuSimulator::writePaced(const uint8_t* data, int len)
+{
+    // Do not hand the bytes over faster than the wire would carry them (10 bits per character)
+    auto start = std::chrono::steady_clock::now();
+    int sent = 0;
+    while (sent < len)
+    {
+        int chunk = this->config.baudrate > 0 ? std::min(8, len - sent) : len - sent;
+        ssize_t w = write(this->master, data + sent, chunk);
+        if (w < 0) { if (errno == EINTR) continue; return; }
+        sent += w;
+        if (this->config.baudrate > 0)
+            std::this_thread::sleep_until(start + std::chrono::microseconds(10000000LL * sent / this->config.baudrate));
+    }
+}
+
+void spuSimulator::runRtu(const std::atomic<bool>& running)
+{
+    // End of frame: 3.5 characters of silence (fixed at 1750 µs above 19200 baud)
+    long t35 = this->config.baudrate > 19200 || this->config.baudrate <= 0 ? 1750 : 35000000L / this->config.baudrate;
+    auto nextDisconnect = std::chrono::steady_clock::now() + this->config.disconnectEvery;
+
+    uint8_t req[MODBUS_RTU_MAX_ADU_LENGTH];
+    uint8_t rsp[MODBUS_RTU_MAX_ADU_LENGTH];
+    int len = 0;
+    while (running)
+    {
+        if (this->config.disconnectEvery.count() > 0 && std::chrono::steady_clock::now() >= nextDisconnect)
+        {
+            close(this->master);
+            this->stats.disconnects++;
+            std::this_thread::sleep_for(this->config.disconnectFor);
+            openPty(this->link);
+            len = 0;
+            nextDisconnect = std::chrono::steady_clock::now() + this->config.disconnectEvery;
+        }
+
+        struct pollfd pfd = {this->master, POLLIN, 0};
+        struct timespec timeout = len > 0 ? timespec{0, t35 * 1000} : timespec{0, 100000000};
+        int ready = ppoll(&pfd, 1, &timeout, nullptr);
+        if (ready > 0 && (pfd.revents & POLLIN))
+        {
+            ssize_t r = read(this->master, req + len, sizeof(req) - len);
+            if (r > 0) len += r;
+            // A read request has a fixed size: answer without waiting for the silent interval
+            if (!(len >= 8 && (req[1] == 0x03 || req[1] == 0x04)) && len < (int)sizeof(req)) continue;
+        }
+        else if (ready > 0)
+        {
+            // The library closed its side: wait for it to come back
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            continue;
+        }
+        if (len == 0) continue;
+
+        double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->t0).count();
+        int n = answer(req, len, rsp, t);
+        len = 0;
+        if (n == 0) continue;
+        if (chance(this->config.dropRate)) { this->stats.dropped++; continue; }
+        if (chance(this->config.crcErrorRate)) { rsp[n-1] ^= 0xFF; this->stats.crcErrors++; }
+        std::this_thread::sleep_for(delay());
+        writePaced(rsp, n);
+        this->stats.answered++;
+    }
+}
+
+void spuSimulator::runTcp(int port, const std::atomic<bool>& running)
+{
+    modbus_t* ctx = modbus_new_tcp("127.0.0.1", port);
+    modbus_mapping_t* map = modbus_mapping_new_start_address(0, 0, 0, 0, 0, SPU_REGISTER_IMAGE_SIZE, 0, SPU_REGISTER_IMAGE_SIZE);
+    int server = ctx && map ? modbus_tcp_listen(ctx, 16) : -1;
+    if (server < 0)
+    {
+        std::cerr << "ERROR in spuSimulator::runTcp() at 127.0.0.1:" << port << "\n\tError code: " << modbus_strerror(errno) << std::endl;
+        if (map) modbus_mapping_free(map);
+        if (ctx) modbus_free(ctx);
+        return;
+    }
+
+    std::vector<int> clients;
+    auto nextDisconnect = std::chrono::steady_clock::now() + this->config.disconnectEvery;
+    uint8_t query[MODBUS_TCP_MAX_ADU_LENGTH];
+    while (running)
+    {
+        if (this->config.disconnectEvery.count() > 0 && std::chrono::steady_clock::now() >= nextDisconnect)
+        {
+            for (int fd : clients) close(fd);
+            clients.clear();
+            this->stats.disconnects++;
+            std::this_thread::sleep_for(this->config.disconnectFor);
+            nextDisconnect = std::chrono::steady_clock::now() + this->config.disconnectEvery;
+        }
+
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(server, &fds);
+        int maxfd = server;
+        for (int fd : clients) { FD_SET(fd, &fds); maxfd = std::max(maxfd, fd); }
+        struct timeval timeout = {0, 100000};
+        if (select(maxfd + 1, &fds, nullptr, nullptr, &timeout) <= 0) continue;
+
+        if (FD_ISSET(server, &fds))
+        {
+            int fd = modbus_tcp_accept(ctx, &server);
+            if (fd >= 0) clients.push_back(fd);
+        }
+        for (size_t i = 0; i < clients.size(); i++)
+        {
+            int fd = clients[i];
+            if (!FD_ISSET(fd, &fds)) continue;
+            modbus_set_socket(ctx, fd);
+            int rc = modbus_receive(ctx, query);
+            if (rc <= 0)
+            {
+                if (rc < 0) { close(fd); clients.erase(clients.begin() + i--); }
+                continue;
+            }
+
+            // MBAP header: the unit identifier is byte 6
+            int slave = query[6];
+            if (std::find(this->config.slaves.begin(), this->config.slaves.end(), slave) == this->config.slaves.end()) continue;
+            this->stats.requests++;
+            if (chance(this->config.dropRate)) { this->stats.dropped++; continue; }
+
+            double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->t0).count();
+            image(slave, t, map->tab_registers);
+            std::copy(map->tab_registers, map->tab_registers + SPU_REGISTER_IMAGE_SIZE, map->tab_input_registers);
+            std::this_thread::sleep_for(delay());
+            if (modbus_reply(ctx, query, rc, map) >= 0) this->stats.answered++;
+        }
+    }
+
+    for (int fd : clients) close(fd);
+    close(server);
+    modbus_mapping_free(map);
+    modbus_free(ctx);
+}
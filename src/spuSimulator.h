@@ -0,0 +1,94 @@
+/*
+This is a simulator of the SystemAtom SPU for libModbusSystematomSPU, a library
+to communicate with the SystemAtom SPU using MODBUS-RTU (RS-485) on a GNU
+operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <libModbusSystematomSPU.h>
+
+#include <atomic>
+#include <random>
+#include <string>
+#include <vector>
+
+//Value of one field along the time
+struct SPU_SIM_WAVE
+{
+    enum SHAPE { CONST, SINE, RAMP, SQUARE, NOISE } shape = CONST;
+    double offset    = 0;
+    double amplitude = 0;
+    double period    = 1;   //Seconds
+};
+
+struct SPU_SIM_CONFIG
+{
+    std::vector<int> slaves = {0x01};           //Slave IDs answered (each one with a phase shift)
+    int baudrate = 57600;                       //Pacing of the answers (0 = as fast as the pty goes)
+    std::chrono::microseconds responseDelay{0}; //Turnaround of the SPU
+    std::chrono::microseconds delayJitter{0};   //Uniform extra delay in [0, delayJitter]
+    double dropRate     = 0;                    //Probability of not answering a request
+    double crcErrorRate = 0;                    //Probability of answering with a wrong CRC
+    std::chrono::milliseconds disconnectEvery{0}; //Hang up the line periodically (0 = never)
+    std::chrono::milliseconds disconnectFor{1000};
+    SPU_SIM_WAVE waves[SPU_FIELD_COUNT];        //Same order as the SPU_FIELD bits
+    unsigned seed = 1;
+};
+
+struct SPU_SIM_STATS
+{
+    std::atomic<unsigned long long> requests{0};
+    std::atomic<unsigned long long> answered{0};
+    std::atomic<unsigned long long> exceptions{0};
+    std::atomic<unsigned long long> dropped{0};
+    std::atomic<unsigned long long> crcErrors{0};
+    std::atomic<unsigned long long> badRequests{0};
+    std::atomic<unsigned long long> disconnects{0};
+};
+
+//Modbus slave that serves the SPU register map with programmable waveforms and faults
+class spuSimulator {
+public:
+    spuSimulator(SPU_SIM_CONFIG config);
+    ~spuSimulator();
+
+    //Create the pseudo-terminal pair and return the name of the side the library opens.
+    //If link is given, it is kept pointing to the current side across disconnects.
+    std::string openPty(std::string link = "");
+
+    //Serve until running becomes false
+    void runRtu(const std::atomic<bool>& running);
+    void runTcp(int port, const std::atomic<bool>& running);
+
+    //Register image of slave at t seconds since the start
+    void image(int slave, double t, uint16_t* regs);
+
+    SPU_SIM_STATS stats;
+
+private:
+    SPU_SIM_CONFIG config;
+    std::mt19937 rng;
+    int master = -1;
+    std::string link;
+    std::chrono::steady_clock::time_point t0;
+
+    bool chance(double p);
+    std::chrono::microseconds delay();
+    int answer(const uint8_t* req, int len, uint8_t* rsp, double t);
+    void writePaced(const uint8_t* data, int len);
+};
@@ -0,0 +1,514 @@
+/*
+These are the unit tests of libModbusSystematomSPU, a library to communicate
+with the SystemAtom SPU using MODBUS-RTU (RS-485) on a GNU operating system.
+Copyright (C) 2023-2024  Thalles Campagnani
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <libModbusSystematomSPU.h>
+#include <libModbusSystematomSPU_aggregate.h>
+#include <libModbusSystematomSPU_archive.h>
+#include <libModbusSystematomSPU_error.h>
+#include <libModbusSystematomSPU_history.h>
+#include <libModbusSystematomSPU_rtu.h>
+
+#include <modbus/modbus.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+// Checks of the pure parts of the library (no port and no simulator needed).
+// The exit status is 1 if any check failed.
+
+using namespace std::chrono;
+
+static int failures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { failures++; \
+    std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); } } while (0)
+
+static bool near(double a, double b, double tolerance)
+{
+    return std::fabs(a - b) <= tolerance * (1 + std::fabs(b));
+}
+
+static system_clock::time_point timeAt(int64_t ns)
+{
+    return system_clock::time_point(duration_cast<system_clock::duration>(nanoseconds(ns)));
+}
+
+// A good sample with random values; flags change every few samples so that runs and edges exist
+static SPU_DATA randomSample(std::mt19937& rng, int64_t ns, unsigned long long seq)
+{
+    std::uniform_real_distribution<float> value(0, 100);
+    SPU_DATA data;
+    data.STATE = 0;
+    data.TIME  = timeAt(ns);
+    data.SEQ   = seq;
+    data.N_DATA_FP  = value(rng);
+    data.T_DATA_FP  = value(rng);
+    data.F1_DATA_FP = value(rng);
+    data.F2_DATA_FP = 42.5f;
+    data.F3_DATA_FP = rng() % 4 ? data.N_DATA_FP : -data.N_DATA_FP;
+    data.EMR_N_THRESHOLD = 90;
+    data.WRN_N_THRESHOLD = 70;
+    data.EMR_T_THRESHOLD = rng() % 2 ? 95 : -1;
+    data.WRN_T_THRESHOLD = 60;
+    int* flags[10] = {&data.EMR_N, &data.WRN_N, &data.EMR_T, &data.WRN_T, &data.R1,
+                      &data.R2, &data.R3, &data.RDY, &data.TEST, &data.XXXX};
+    for (int k = 0; k < 10; k++) *flags[k] = (seq / (k + 2)) % 2;
+    if (rng() % 16 == 0) data.XXXX = -1;
+    return data;
+}
+
+static bool sameRecord(const SPU_RECORD& a, const SPU_RECORD& b)
+{
+    return a.time_ns == b.time_ns && a.seq == b.seq && std::memcmp(a.fp, b.fp, sizeof(a.fp)) == 0 &&
+           a.flags == b.flags && a.flagsKnown == b.flagsKnown && a.state == b.state;
+}
+
+static void testCrc()
+{
+    const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    CHECK(libModbusSystematomSPU_crc16(check, sizeof(check)) == 0x4B37);
+
+    uint8_t frame[SPU_RTU_REQUEST_SIZE];
+    const uint8_t readOne[SPU_RTU_REQUEST_SIZE] = {0x01, 0x03, 0x00, 0x00, 0x00, 0x01, 0x84, 0x0A};
+    CHECK(libModbusSystematomSPU_rtu_request(frame, 1, 0x0000, 1) == SPU_RTU_REQUEST_SIZE);
+    CHECK(std::memcmp(frame, readOne, SPU_RTU_REQUEST_SIZE) == 0);
+    const uint8_t readTen[SPU_RTU_REQUEST_SIZE] = {0x01, 0x03, 0x00, 0x00, 0x00, 0x0A, 0xC5, 0xCD};
+    libModbusSystematomSPU_rtu_request(frame, 1, 0x0000, 10);
+    CHECK(std::memcmp(frame, readTen, SPU_RTU_REQUEST_SIZE) == 0);
+}
+
+static void testFrames()
+{
+    // Answer of slave 1 to a read of 4 registers
+    const int regs = 4;
+    const int size = libModbusSystematomSPU_rtu_response_size(regs);
+    uint8_t frame[SPU_RTU_MAX_FRAME_SIZE] = {0x01, 0x03, 2 * regs};
+    for (int i = 0; i < 2 * regs; i++) frame[3 + i] = uint8_t(0x10 + i);
+    uint16_t crc = libModbusSystematomSPU_crc16(frame, size - 2);
+    frame[size - 2] = crc & 0xFF;
+    frame[size - 1] = crc >> 8;
+
+    // The answer arriving in two reads split at every byte, then in random chunks
+    std::mt19937 rng(1);
+    for (int split = 0; split <= size; split++)
+    {
+        uint8_t buffer[SPU_RTU_MAX_FRAME_SIZE];
+        int len = 0;
+        std::memcpy(buffer, frame, split);
+        len += split;
+        CHECK(libModbusSystematomSPU_rtu_missing(buffer, len, regs) == size - split);
+        int missing = libModbusSystematomSPU_rtu_missing(buffer, len, regs);
+        while (missing > 0)
+        {
+            int chunk = 1 + rng() % missing;
+            std::memcpy(buffer + len, frame + len, chunk);
+            len += chunk;
+            missing = libModbusSystematomSPU_rtu_missing(buffer, len, regs);
+            CHECK(missing == size - len);
+        }
+        uint16_t dest[regs] = {};
+        CHECK(libModbusSystematomSPU_rtu_response(buffer, len, 1, regs, dest) == regs);
+        CHECK(dest[0] == 0x1011 && dest[1] == 0x1213 && dest[2] == 0x1415 && dest[3] == 0x1617);
+    }
+
+    uint16_t dest[regs];
+    for (int len = 0; len < size; len++)
+        CHECK(libModbusSystematomSPU_rtu_response(frame, len, 1, regs, dest) == -1);
+    errno = 0;
+    CHECK(libModbusSystematomSPU_rtu_response(frame, size, 2, regs, dest) == -1 && errno == EMBBADSLAVE);
+    errno = 0;
+    CHECK(libModbusSystematomSPU_rtu_response(frame, size, 1, regs + 1, dest) == -1 && errno == EMBBADDATA);
+    frame[4] ^= 0x01;
+    errno = 0;
+    CHECK(libModbusSystematomSPU_rtu_response(frame, size, 1, regs, dest) == -1 && errno == EMBBADCRC);
+
+    // An exception answer is shorter: recognised from its function byte on
+    uint8_t exception[SPU_RTU_EXCEPTION_SIZE] = {0x01, 0x83, 0x02};
+    crc = libModbusSystematomSPU_crc16(exception, 3);
+    exception[3] = crc & 0xFF;
+    exception[4] = crc >> 8;
+    CHECK(libModbusSystematomSPU_rtu_missing(exception, 1, regs) == size - 1);
+    CHECK(libModbusSystematomSPU_rtu_missing(exception, 2, regs) == SPU_RTU_EXCEPTION_SIZE - 2);
+    CHECK(libModbusSystematomSPU_rtu_missing(exception, SPU_RTU_EXCEPTION_SIZE, regs) == 0);
+    errno = 0;
+    CHECK(libModbusSystematomSPU_rtu_response(exception, SPU_RTU_EXCEPTION_SIZE, 1, regs, dest) == -1 &&
+          errno == MODBUS_ENOBASE + 2);
+}
+
+// Cheapest way to cut the spans into consecutive transactions, trying every cut
+static float bruteForceCost(const std::vector<SPU_READ_BLOCK>& spans, const SPU_READ_COST& cost)
+{
+    if (spans.empty()) return 0;
+    int n = int(spans.size());
+    float best = std::numeric_limits<float>::infinity();
+    for (uint32_t cuts = 0; cuts < (1u << (n - 1)); cuts++)    // Bit i: a transaction ends after span i
+    {
+        float c = 0;
+        bool fits = true;
+        for (int i = 0, first = 0; i < n; i++)
+        {
+            if (i < n - 1 && !(cuts >> i & 1)) continue;
+            int len = spans[i].start_address + spans[i].num_registers - spans[first].start_address;
+            fits = fits && len <= SPU_MAX_READ_REGISTERS;
+            c += cost.transactionCost + cost.registerCost * len;
+            first = i + 1;
+        }
+        if (fits) best = std::min(best, c);
+    }
+    return best;
+}
+
+static void testPlan()
+{
+    // Registers of each field, found by encoding zeros over a marked register image
+    std::vector<bool> fieldRegs[SPU_FIELD_COUNT];
+    for (int k = 0; k < SPU_FIELD_COUNT; k++)
+    {
+        SPU_DATA zero;
+        zero.N_DATA_FP = zero.T_DATA_FP = zero.F1_DATA_FP = zero.F2_DATA_FP = zero.F3_DATA_FP = 0;
+        zero.EMR_N_THRESHOLD = zero.WRN_N_THRESHOLD = zero.EMR_T_THRESHOLD = zero.WRN_T_THRESHOLD = 0;
+        zero.EMR_N = zero.WRN_N = zero.EMR_T = zero.WRN_T = zero.R1 = zero.R2 = zero.R3 = zero.RDY = zero.TEST = zero.XXXX = 0;
+        uint16_t regs[SPU_REGISTER_IMAGE_SIZE];
+        std::fill(regs, regs + SPU_REGISTER_IMAGE_SIZE, 0xABCD);
+        libModbusSystematomSPU_encode(zero, regs, 1u << k);
+        for (int a = 0; a < SPU_REGISTER_IMAGE_SIZE; a++) fieldRegs[k].push_back(regs[a] != 0xABCD);
+    }
+
+    std::vector<SPU_READ_COST> costs;
+    for (int baudrate : {1200, 9600, 57600, 115200, 921600}) costs.push_back(libModbusSystematomSPU_cost(baudrate, 1000));
+    costs.push_back({1, 1000});     // Never worth reading a gap
+    costs.push_back({1000, 0});     // Always worth it
+
+    std::mt19937 rng(2);
+    for (int t = 0; t < 2000; t++)
+    {
+        uint32_t fields = t == 0 ? 0 : t == 1 ? uint32_t(SPU_FIELD_ALL) : rng() & rng() & SPU_FIELD_ALL;
+        std::vector<bool> wanted(SPU_REGISTER_IMAGE_SIZE, false);
+        for (int k = 0; k < SPU_FIELD_COUNT; k++)
+            if (fields >> k & 1)
+                for (int a = 0; a < SPU_REGISTER_IMAGE_SIZE; a++) if (fieldRegs[k][a]) wanted[a] = true;
+        std::vector<SPU_READ_BLOCK> spans;
+        for (int a = 0; a < SPU_REGISTER_IMAGE_SIZE; a++)
+        {
+            if (!wanted[a]) continue;
+            if (a > 0 && wanted[a - 1]) spans.back().num_registers++;
+            else spans.push_back({a, 1});
+        }
+
+        const SPU_READ_COST& cost = costs[t % costs.size()];
+        SPU_READ_PLAN plan = libModbusSystematomSPU_plan(fields, cost);
+        CHECK(plan.fields == fields);
+        CHECK(near(plan.cost, bruteForceCost(spans, cost), 1e-5));
+
+        // Sorted, disjoint, within the protocol limit, covering every wanted register, and costing what it says
+        std::vector<bool> covered(SPU_REGISTER_IMAGE_SIZE, false);
+        float sum = 0;
+        for (int i = 0; i < plan.numBlocks; i++)
+        {
+            const SPU_READ_BLOCK& b = plan.blocks[i];
+            CHECK(b.num_registers > 0 && b.num_registers <= SPU_MAX_READ_REGISTERS);
+            CHECK(i == 0 || plan.blocks[i - 1].start_address + plan.blocks[i - 1].num_registers <= b.start_address);
+            for (int a = b.start_address; a < b.start_address + b.num_registers && a < SPU_REGISTER_IMAGE_SIZE; a++) covered[a] = true;
+            sum += cost.transactionCost + cost.registerCost * b.num_registers;
+        }
+        for (int a = 0; a < SPU_REGISTER_IMAGE_SIZE; a++) CHECK(!wanted[a] || covered[a]);
+        CHECK(near(sum, plan.cost, 1e-5));
+    }
+}
+
+static void testHistory()
+{
+    libModbusSystematomSPU_history history(64);
+    CHECK(history.capacity() == 64);
+
+    // Three and a bit laps of the ring, so that windows and flag words wrap around
+    std::mt19937 rng(3);
+    std::vector<float> values;
+    std::vector<bool> flags;
+    const int64_t t0 = 1700000000LL * 1000000000LL;
+    for (int i = 0; i < 200; i++)
+    {
+        SPU_DATA data = randomSample(rng, t0 + i * 1000000LL, i);
+        data.EMR_N = rng() % 3 == 0;
+        CHECK(history.append(data) == 0);
+        values.push_back(data.N_DATA_FP);
+        flags.push_back(data.EMR_N == 1);
+        if (i == 100)
+        {
+            SPU_DATA failed = data;
+            failed.STATE = 1;
+            CHECK(history.append(failed) == 1);
+        }
+    }
+    CHECK(history.end() == 200 && history.first() == 200 - 64 && history.size() == 64);
+    for (uint64_t i = history.first(); i < history.end(); i++)
+    {
+        CHECK(history.value(SPU_FIELD_N_DATA_FP, i) == values[i]);
+        CHECK(history.flag(SPU_FIELD_EMR_N, i) == flags[i]);
+    }
+
+    const float threshold = 50;
+    for (uint64_t begin = history.first() - 3; begin <= history.end() + 1; begin++)
+    {
+        for (uint64_t end = begin; end <= history.end() + 2; end++)
+        {
+            uint64_t b = std::max(begin, history.first()), e = std::min(end, history.end());
+
+            SPU_WINDOW_STATS stats = history.stats(SPU_FIELD_N_DATA_FP, begin, end);
+            CHECK(stats.count == (e > b ? e - b : 0));
+            if (e > b)
+            {
+                double sum = 0, sumsq = 0;
+                float mn = values[b], mx = values[b];
+                for (uint64_t i = b; i < e; i++)
+                {
+                    sum += values[i];
+                    mn = std::min(mn, values[i]);
+                    mx = std::max(mx, values[i]);
+                }
+                double mean = sum / (e - b);
+                for (uint64_t i = b; i < e; i++) sumsq += (values[i] - mean) * (values[i] - mean);
+                CHECK(stats.min == mn && stats.max == mx);
+                CHECK(near(stats.mean, mean, 1e-9));
+                CHECK(near(stats.variance, sumsq / (e - b), 1e-6));
+            }
+
+            for (bool rising : {true, false})
+            {
+                uint64_t crossing = end;
+                for (uint64_t i = b + 1; i < e && crossing == end; i++)
+                    if (rising ? (values[i - 1] < threshold && values[i] >= threshold) : (values[i - 1] >= threshold && values[i] < threshold))
+                        crossing = i;
+                CHECK(history.find_crossing(SPU_FIELD_N_DATA_FP, threshold, begin, end, rising) == crossing);
+
+                std::vector<uint64_t> edges;
+                for (uint64_t i = b + 1; i < e; i++)
+                    if (flags[i] != flags[i - 1] && flags[i] == rising) edges.push_back(i);
+                uint64_t out[64];
+                size_t n = history.flag_edges(SPU_FIELD_EMR_N, begin, end, out, 64, rising);
+                CHECK(std::vector<uint64_t>(out, out + n) == edges);
+                if (edges.size() > 1) CHECK(history.flag_edges(SPU_FIELD_EMR_N, begin, end, out, 1, rising) == 1 && out[0] == edges[0]);
+            }
+        }
+    }
+}
+
+static void testAggregator()
+{
+    // Two and a half hours of samples, all of them still held at 1 s, so that any range whole in seconds has an
+    // exact answer. Intervals go past maxGap now and then, and some reads fail.
+    const int64_t second = 1000000000LL;
+    const int64_t t0 = 1700000000LL * second + 1234 * second + 567;
+    libModbusSystematomSPU_aggregator aggregator(4 * 3600, 1440, 720, seconds(1));
+    std::mt19937 rng(4);
+    std::vector<SPU_DATA> samples;
+    int64_t t = t0;
+    for (unsigned long long seq = 0; t < t0 + 9000 * second; seq++)
+    {
+        SPU_DATA data = randomSample(rng, t, seq);
+        if (rng() % 50 == 0) data.STATE = 1;
+        CHECK(aggregator.add(data) == (data.STATE != 0));
+        samples.push_back(data);
+        t += rng() % 20 == 0 ? 1500000000LL : int64_t(rng() % 900000000LL) + 1;
+    }
+
+    auto check = [&](int64_t f, int64_t e)
+    {
+        SPU_AGGREGATE reference;
+        auto overlap = [&](int64_t s0, int64_t s1) { return nanoseconds(std::max<int64_t>(0, std::min(s1, e) - std::max(s0, f))); };
+        const SPU_DATA* prev = nullptr;
+        for (const SPU_DATA& data : samples)
+        {
+            if (data.STATE != 0) { prev = nullptr; continue; }
+            int64_t ns = duration_cast<nanoseconds>(data.TIME.time_since_epoch()).count();
+            if (prev)
+            {
+                int64_t pns = duration_cast<nanoseconds>(prev->TIME.time_since_epoch()).count();
+                if (ns - pns <= second)
+                {
+                    nanoseconds dt = overlap(pns, ns);
+                    reference.covered += dt;
+                    if (prev->N_DATA_FP > prev->WRN_N_THRESHOLD) reference.aboveWrnN += dt;
+                    if (prev->N_DATA_FP > prev->EMR_N_THRESHOLD) reference.aboveEmrN += dt;
+                    if (prev->T_DATA_FP > prev->WRN_T_THRESHOLD) reference.aboveWrnT += dt;
+                    if (prev->EMR_T_THRESHOLD >= 0 && prev->T_DATA_FP > prev->EMR_T_THRESHOLD) reference.aboveEmrT += dt;
+                    SPU_RECORD record = libModbusSystematomSPU_pack(*prev);
+                    for (int k = 0; k < 10; k++)
+                        if (record.flags & record.flagsKnown & (1u << k)) reference.flagOn[k] += dt;
+                }
+            }
+            if (ns >= f && ns < e)
+            {
+                reference.N.add(data.N_DATA_FP);
+                reference.T.add(data.T_DATA_FP);
+            }
+            prev = &data;
+        }
+
+        SPU_AGGREGATE a = aggregator.query(timeAt(f), timeAt(e));
+        CHECK(a.covered == reference.covered);
+        CHECK(a.aboveWrnN == reference.aboveWrnN && a.aboveEmrN == reference.aboveEmrN);
+        CHECK(a.aboveWrnT == reference.aboveWrnT && a.aboveEmrT == reference.aboveEmrT);
+        for (int k = 0; k < 10; k++) CHECK(a.flagOn[k] == reference.flagOn[k]);
+        for (auto [got, want] : {std::pair{&a.N, &reference.N}, std::pair{&a.T, &reference.T}})
+        {
+            CHECK(got->count == want->count);
+            if (want->count == 0) continue;
+            CHECK(got->min == want->min && got->max == want->max);
+            CHECK(near(got->mean, want->mean, 1e-9));
+            CHECK(near(got->m2, want->m2, 1e-6));
+        }
+    };
+
+    // Whole hours, hours with minute and second edges, and random ranges
+    const int64_t hour = 3600 * second;
+    int64_t firstHour = (t0 / hour + 1) * hour;
+    check(firstHour, firstHour + hour);
+    check(firstHour - 61 * second, firstHour + hour + 61 * second);
+    check(t0 / second * second - 10 * second, t + 10 * second);
+    for (int i = 0; i < 200; i++)
+    {
+        int64_t f = t0 / second * second + int64_t(rng() % 9010) * second - 5 * second;
+        int64_t e = f + int64_t(rng() % 9010) * second;
+        check(f, e);
+    }
+}
+
+static void testArchive()
+{
+    char dir[] = "/tmp/spu-unittest-XXXXXX";
+    if (mkdtemp(dir) == nullptr)
+    {
+        CHECK(false);
+        return;
+    }
+    const std::string path = std::string(dir) + "/archive";
+    const uint32_t blockSamples = 64;
+    std::mt19937 rng(5);
+
+    // Block boundaries: one sample, one short of a block, a full block, one over, and a few blocks
+    for (uint64_t count : {1, 63, 64, 65, 128, 200})
+    {
+        unlink(path.c_str());
+        std::vector<SPU_RECORD> expected;
+        {
+            libModbusSystematomSPU_archive archive(path, blockSamples);
+            CHECK(archive.isOpen());
+            int64_t t = 1700000000LL * 1000000000LL;
+            unsigned long long seq = 1;
+            for (uint64_t i = 0; i < count; i++)
+            {
+                // Regular steps, jitter, long pauses and a clock stepped back exercise every delta-of-delta bucket
+                switch (rng() % 8)
+                {
+                    case 0:  t += int64_t(rng() % 4000) * 3600 * 1000000000LL; break;
+                    case 1:  t -= 5000000; break;
+                    case 2:  t += rng() % 1000; break;
+                    default: t += 10000000; break;
+                }
+                seq += rng() % 16 == 0 ? 1 + rng() % 100000 : 1;
+                SPU_DATA data = randomSample(rng, t, seq);
+                CHECK(archive.append(data) == 0);
+                SPU_RECORD record = libModbusSystematomSPU_pack(data);
+                if (!expected.empty()) record.time_ns = std::max(record.time_ns, expected.back().time_ns);
+                expected.push_back(record);
+            }
+            CHECK(archive.size() == count);
+        }
+
+        libModbusSystematomSPU_archive_reader reader(path);
+        CHECK(reader.isOpen());
+        CHECK(reader.size() == count);
+        CHECK(reader.blocks() == (count + blockSamples - 1) / blockSamples);
+        std::vector<SPU_RECORD> decoded;
+        for (size_t b = 0; b < reader.blocks(); b++)
+        {
+            std::vector<SPU_RECORD> out;
+            CHECK(reader.decode(b, out) == 0);
+            CHECK(out.size() == reader.block(b).count);
+            decoded.insert(decoded.end(), out.begin(), out.end());
+        }
+        CHECK(decoded.size() == expected.size());
+        for (size_t i = 0; i < std::min(decoded.size(), expected.size()); i++) CHECK(sameRecord(decoded[i], expected[i]));
+
+        std::vector<SPU_RECORD> all = reader.query(timeAt(0), system_clock::time_point::max(), 2);
+        CHECK(all.size() == expected.size());
+        for (size_t i = 0; i < std::min(all.size(), expected.size()); i++) CHECK(sameRecord(all[i], expected[i]));
+
+        // A damaged block is skipped by query(), which moves the blocks after it down over its samples
+        if (reader.blocks() < 3) continue;
+        SPU_ARCHIVE_BLOCK damaged = reader.block(1);
+        int fd = open(path.c_str(), O_RDWR);
+        uint8_t byte = 0;
+        off_t offset = off_t(damaged.offset + sizeof(SPU_ARCHIVE_BLOCK) + damaged.payloadSize / 2);
+        CHECK(fd >= 0 && pread(fd, &byte, 1, offset) == 1);
+        byte ^= 0x5A;
+        CHECK(pwrite(fd, &byte, 1, offset) == 1);
+        close(fd);
+
+        // The damage is expected: keep its report in the log only
+        libModbusSystematomSPU_set_error_sink(nullptr);
+        libModbusSystematomSPU_archive_reader corrupted(path);
+        std::vector<SPU_RECORD> out;
+        CHECK(corrupted.decode(1, out) == 1);
+        SPU_ERROR last;
+        CHECK(libModbusSystematomSPU_errors(&last, 1) == 1 && last.code == SPU_ERROR_ARCHIVE);
+        std::vector<SPU_RECORD> survivors;
+        for (size_t i = 0; i < expected.size(); i++)
+            if (i < blockSamples || i >= 2 * blockSamples) survivors.push_back(expected[i]);
+        for (unsigned threads : {1u, 0u})
+        {
+            std::vector<SPU_RECORD> rest = corrupted.query(timeAt(0), system_clock::time_point::max(), threads);
+            CHECK(rest.size() == survivors.size());
+            for (size_t i = 0; i < std::min(rest.size(), survivors.size()); i++) CHECK(sameRecord(rest[i], survivors[i]));
+        }
+        libModbusSystematomSPU_set_error_sink(libModbusSystematomSPU_stderr_sink);
+    }
+    unlink(path.c_str());
+    rmdir(dir);
+}
+
+int main()
+{
+    testCrc();
+    testFrames();
+    testPlan();
+    testHistory();
+    testAggregator();
+    testArchive();
+
+    if (failures > 0)
+    {
+        std::fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    std::printf("All checks passed\n");
+    return 0;
+}